@@ -16,6 +16,17 @@
 #include <inttypes.h>
 #include <sys/time.h>
 #include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <stddef.h>
 
 #include <gnu/lib-names.h>
 
@@ -26,6 +37,8 @@
 #include <X11/extensions/randr.h>
 #include <X11/extensions/randrproto.h>
 #include <X11/extensions/panoramiXproto.h>
+#include <X11/extensions/XKBproto.h>
+#include <GL/glxproto.h>
 
 // ****************************************************************************
 
@@ -73,6 +86,22 @@ struct Config
 	char noResolutionChange;
 	char noWindowStackMove;
 	char noWMRaise;
+	char cacheKeymap;
+	char cacheGLX;
+	char cacheFonts;
+	char mirrorGeometry;
+	char trackPointer;
+	char cacheRootProperties;
+	char prefetch;
+	char compressMotion;
+	char compressConfigure;
+	char coalesceConfigure;
+	char duplexThreads;
+	char latencyMode;
+	int relayCPU;
+	char daemon;
+	int display; // standalone server only
+	int serverPool; // standalone server only
 
 	unsigned int fakeScreenW;
 	unsigned int fakeScreenH;
@@ -80,9 +109,78 @@ struct Config
 	unsigned int fakeScreenDimH;
 
 	struct MapConfig *maps;
+	struct PrefetchConfig *prefetches;
 };
 
-static struct Config config = {};
+/// Integer options, as X(field); the option name is the field name (case-insensitive).
+#define CONFIG_INTS(X) \
+	X(mainX) \
+	X(mainY) \
+	X(mainW) \
+	X(mainH) \
+	X(desktopW) \
+	X(desktopH) \
+	X(actualX) \
+	X(actualY) \
+	\
+	X(mst2X) \
+	X(mst2Y) \
+	X(mst2W) \
+	X(mst2H) \
+	X(mst3X) \
+	X(mst3Y) \
+	X(mst3W) \
+	X(mst3H) \
+	X(mst4X) \
+	X(mst4Y) \
+	X(mst4W) \
+	X(mst4H) \
+	\
+	X(enable) \
+	X(debug) \
+	X(logTimestamp) \
+	X(joinMST) \
+	X(maskOtherMonitors) \
+	X(resizeWindows) \
+	X(resizeAll) \
+	X(moveWindows) \
+	X(fork) \
+	X(filterFocus) \
+	X(noMouseGrab) \
+	X(noKeyboardGrab) \
+	X(noPrimarySelection) \
+	X(noMinSize) \
+	X(noMaxSize) \
+	X(dumb) \
+	X(confineMouse) \
+	X(noResolutionChange) \
+	X(noWindowStackMove) \
+	X(noWMRaise) \
+	X(cacheKeymap) \
+	X(cacheGLX) \
+	X(cacheFonts) \
+	X(mirrorGeometry) \
+	X(trackPointer) \
+	X(cacheRootProperties) \
+	X(prefetch) \
+	X(compressMotion) \
+	X(compressConfigure) \
+	X(coalesceConfigure) \
+	X(duplexThreads) \
+	X(latencyMode) \
+	X(relayCPU) \
+	X(daemon) \
+	X(display) \
+	X(serverPool) \
+	\
+	X(fakeScreenW) \
+	X(fakeScreenH) \
+	X(fakeScreenDimW) \
+	X(fakeScreenDimH)
+
+// Per thread, so that relay threads in the daemon can each use the profile
+// of the application they serve.
+static __thread struct Config config = {};
 
 static void log_error(const char *fmt, ...)
 	__attribute__ ((format (printf, 1, 2)));
@@ -175,13 +273,32 @@ struct MapConfig
 	struct MapConfig *next;
 };
 
-static char configLoaded = 0;
+/// Targets of all mappings for one key or button (compiled from config.maps)
+struct MapTable
+{
+	struct MapInput *targets;
+	unsigned int count;
+};
+static __thread struct MapTable mapTables[2][256]; // indexed by MAP_KIND_* and key/button code
+
+struct PrefetchConfig
+{
+	CARD8 reqType; // X_QueryExtension or X_InternAtom
+	struct PrefetchConfig *next;
+	char name[];
+};
+
+static __thread char configLoaded = 0;
+
+/// Incremented when the profiles change (see configWatcherProc)
+static unsigned int configGeneration = 0;
+/// configGeneration as of when the calling thread loaded its configuration
+static __thread unsigned int configLoadedGeneration;
+
+/// Profile to use instead of the one getProfileName picks (for the daemon)
+static __thread const char *profileOverride = NULL;
 
 enum { maxMST = 4 };
-static          int* mstConfigX[maxMST] = { &config.mainX, &config.mst2X, &config.mst3X, &config.mst4X };
-static          int* mstConfigY[maxMST] = { &config.mainY, &config.mst2Y, &config.mst3Y, &config.mst4Y };
-static unsigned int* mstConfigW[maxMST] = { &config.mainW, &config.mst2W, &config.mst3W, &config.mst4W };
-static unsigned int* mstConfigH[maxMST] = { &config.mainH, &config.mst2H, &config.mst3H, &config.mst4H };
 
 int parseInt(const char *s)
 {
@@ -208,7 +325,9 @@ bool parseInput(struct MapInput *input, const char *s)
 	return true;
 }
 
-static void readConfig(const char* fn)
+/// Read a profile file into config. quiet suppresses warnings (for when it
+/// is not the calling program's profile, see buildProfileIndex).
+static void readConfig(const char* fn, bool quiet)
 {
 	//log_debug("Reading config from %s\n", fn);
 	FILE* f = fopen(fn, "r");
@@ -245,60 +364,26 @@ static void readConfig(const char* fn)
 			continue;
 		}
 
+		if (!strcasecmp("PrefetchExtension", buf) || !strcasecmp("PrefetchAtom", buf))
+		{
+			p[strcspn(p, "\r\n")] = 0;
+			struct PrefetchConfig *prefetch = malloc(sizeof(struct PrefetchConfig) + strlen(p) + 1);
+			prefetch->reqType = !strcasecmp("PrefetchAtom", buf) ? X_InternAtom : X_QueryExtension;
+			strcpy(prefetch->name, p);
+			prefetch->next = config.prefetches;
+			config.prefetches = prefetch;
+			continue;
+		}
+
 		#define PARSE_INT(x)						\
 			if (!strcasecmp(buf, #x))				\
 				config.x = parseInt(p);				\
 			else
 
-		PARSE_INT(mainX)
-		PARSE_INT(mainY)
-		PARSE_INT(mainW)
-		PARSE_INT(mainH)
-		PARSE_INT(desktopW)
-		PARSE_INT(desktopH)
-		PARSE_INT(actualX)
-		PARSE_INT(actualY)
-
-		PARSE_INT(mst2X)
-		PARSE_INT(mst2Y)
-		PARSE_INT(mst2W)
-		PARSE_INT(mst2H)
-		PARSE_INT(mst3X)
-		PARSE_INT(mst3Y)
-		PARSE_INT(mst3W)
-		PARSE_INT(mst3H)
-		PARSE_INT(mst4X)
-		PARSE_INT(mst4Y)
-		PARSE_INT(mst4W)
-		PARSE_INT(mst4H)
-
-		PARSE_INT(enable)
-		PARSE_INT(debug)
-		PARSE_INT(logTimestamp)
-		PARSE_INT(joinMST)
-		PARSE_INT(maskOtherMonitors)
-		PARSE_INT(resizeWindows)
-		PARSE_INT(resizeAll)
-		PARSE_INT(moveWindows)
-		PARSE_INT(fork)
-		PARSE_INT(filterFocus)
-		PARSE_INT(noMouseGrab)
-		PARSE_INT(noKeyboardGrab)
-		PARSE_INT(noPrimarySelection)
-		PARSE_INT(noMinSize)
-		PARSE_INT(noMaxSize)
-		PARSE_INT(dumb)
-		PARSE_INT(confineMouse)
-		PARSE_INT(noResolutionChange)
-		PARSE_INT(noWindowStackMove)
-		PARSE_INT(noWMRaise)
-
-		PARSE_INT(fakeScreenW)
-		PARSE_INT(fakeScreenH)
-		PARSE_INT(fakeScreenDimW)
-		PARSE_INT(fakeScreenDimH)
+		CONFIG_INTS(PARSE_INT)
 
 		/* else */
+		if (!quiet)
 			log_error("Unknown option: %s\n", buf);
 
 		#undef PARSE_INT
@@ -310,36 +395,424 @@ static void readConfig(const char* fn)
 // ****************************************************************************
 
 static void getProfileName(char *buf, size_t size);
+static void startThread(void* (*proc)(void*), void* arg);
+static void compileRequestActions();
+static void compileEventActions();
 
-static void needConfig()
+// Build the lookup tables for config.maps, keeping the order of the list.
+static void compileMaps()
 {
-	if (configLoaded)
-		return;
-	configLoaded = 1;
+	for (struct MapConfig *map = config.maps; map; map = map->next)
+		if (map->from.code < 256)
+			mapTables[map->from.kind][map->from.code].count++;
+		else
+			log_error("Bad map code: %u\n", map->from.code);
+
+	for (int kind = 0; kind < 2; kind++)
+		for (int code = 0; code < 256; code++)
+		{
+			struct MapTable *table = &mapTables[kind][code];
+			if (table->count)
+				table->targets = malloc(table->count * sizeof(struct MapInput));
+			table->count = 0;
+		}
+
+	for (struct MapConfig *map = config.maps; map; map = map->next)
+		if (map->from.code < 256)
+		{
+			struct MapTable *table = &mapTables[map->from.kind][map->from.code];
+			table->targets[table->count++] = map->to;
+		}
+}
 
-	// Default settings
+static void spinLock(volatile char *lock)
+{
+	while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void spinUnlock(volatile char *lock)
+{
+	__atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static void configDefaults()
+{
+	memset(&config, 0, sizeof(config));
 	config.mainX = 0;
 	config.mainY = 0;
 	config.mainW = 3840;
 	config.mainH = 2160;
 	config.desktopW = 3840;
 	config.desktopH = 2160;
+	config.relayCPU = -1;
+	config.serverPool = 4;
+}
 
-	char buf[1024] = {0};
+static void freeConfigLists()
+{
+	while (config.maps)
+	{
+		struct MapConfig *next = config.maps->next;
+		free(config.maps);
+		config.maps = next;
+	}
+	while (config.prefetches)
+	{
+		struct PrefetchConfig *next = config.prefetches->next;
+		free(config.prefetches);
+		config.prefetches = next;
+	}
+}
+
+static bool getProfilesPath(char *buf, size_t size, bool create)
+{
 	char *home = getenv("HOME");
-	if (!home)
+	if (!home || strlen(home) + 32 > size)
+		return false;
+	strcpy(buf, home);
+	strcat(buf, "/.config"	); if (create) mkdir(buf, 0700); // TODO: XDG_CONFIG_HOME
+	strcat(buf, "/hax11"); if (create) mkdir(buf, 0700);
+	strcat(buf, "/profiles"	); if (create) mkdir(buf, 0700);
+	return true;
+}
+
+// ****************************************************************************
+// Profile index: the configuration of every profile, compiled into one file
+// under ~/.cache/hax11/, which each process maps once. Loading the
+// configuration is then a hash probe and two or three stat calls, instead of
+// creating directories and parsing text files, which matters when hax11 is
+// preloaded into every program.
+// The index is rebuilt by the first process which finds that the profiles
+// directory (i.e. the set of profiles), the default profile, or its own
+// profile has changed since. Profiles with Map or Prefetch options (which
+// are lists) are still read from their files.
+
+#define PROFILE_INDEX_MAGIC "hax11pi1"
+
+/// Modification time and size of a file, to tell whether it has changed.
+struct FileStamp
+{
+	int64_t sec, nsec;
+	int64_t size; // -1 if the file does not exist
+};
+
+struct ProfileIndexEntry
+{
+	CARD32 hash; // of the name
+	CARD32 nameOffset, nameLength; // name (not NUL-terminated), from the start of the file
+	struct FileStamp stamp;
+	char hasLists; // has Map or Prefetch options, which are not in config
+	struct Config config; // the default profile, then this one; with no lists
+};
+
+/// The file starts with this, followed by the hash table (CARD32 bucket[buckets],
+/// 1 + the index of an entry, or 0 if empty; linear probing), the entries,
+/// and the names.
+struct ProfileIndexHeader
+{
+	char magic[8];
+	CARD32 layout; // configLayout() of the writer
+	CARD32 buckets; // a power of two
+	CARD32 count;
+	CARD32 size; // of the whole file
+	struct FileStamp dir, defaultProfile;
+	struct ProfileIndexEntry fallback; // only the default profile, for programs without one
+};
+
+/// The mapped index (shared by all threads)
+static struct
+{
+	volatile char lock;
+	const struct ProfileIndexHeader *header;
+} profileIndex;
+
+enum { INDEX_HIT, INDEX_MISS, INDEX_STALE };
+
+static CARD32 hashBytes(CARD32 hash, const void* buf, size_t length);
+
+/// Identifies the layout of struct Config, so that an index written by a
+/// different build of hax11 is not used.
+static CARD32 configLayout()
+{
+	CARD32 hash = 2166136261u;
+	#define HASH_FIELD(x)																		\
+		hash = hashBytes(hash, #x, sizeof(#x));													\
+		hash = hashBytes(hash, &(size_t){ offsetof(struct Config, x) }, sizeof(size_t));		\
+		hash = hashBytes(hash, &(size_t){ sizeof(((struct Config*)0)->x) }, sizeof(size_t));
+	CONFIG_INTS(HASH_FIELD)
+	#undef HASH_FIELD
+	size_t size = sizeof(struct ProfileIndexEntry);
+	return hashBytes(hash, &size, sizeof(size));
+}
+
+static void fileStamp(const char *fn, struct FileStamp *stamp)
+{
+	struct stat st;
+	if (stat(fn, &st) == 0)
+		*stamp = (struct FileStamp){ st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size };
+	else
+		*stamp = (struct FileStamp){ 0, 0, -1 };
+}
+
+static bool sameStamp(const struct FileStamp *a, const struct FileStamp *b)
+{
+	return a->sec == b->sec && a->nsec == b->nsec && a->size == b->size;
+}
+
+/// The default profile and the calling thread's own, as of when it loaded its
+/// configuration (see configChanged)
+static __thread struct FileStamp configStamps[2];
+
+static bool getCachePath(char *buf, size_t size, const char *name);
+
+static void getProfileIndexPath(char *buf, size_t size, bool create)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "profiles-%zu.idx", sizeof(void*) * 8); // lib32 and lib64 differ
+	if (create)
+		getCachePath(buf, size, name);
+	else
+		snprintf(buf, size, "%s/.cache/hax11/%s", getenv("HOME"), name);
+}
+
+// Called with the lock held.
+static void mapProfileIndex()
+{
+	char fn[1024];
+	getProfileIndexPath(fn, sizeof(fn), false);
+	int fd = open(fn, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 		return;
-	strncpy(buf, home, sizeof(buf)-100);
-	strcat(buf, "/.config"	); mkdir(buf, 0700); // TODO: XDG_CONFIG_HOME
-	strcat(buf, "/hax11"); mkdir(buf, 0700);
-	strcat(buf, "/profiles"	); mkdir(buf, 0700);
-	char *p = buf + strlen(buf);
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct ProfileIndexHeader))
+	{
+		const struct ProfileIndexHeader *header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (header != MAP_FAILED)
+		{
+			if (!memcmp(header->magic, PROFILE_INDEX_MAGIC, sizeof(header->magic))
+			 && header->layout == configLayout()
+			 && header->size == st.st_size
+			 && header->buckets && !(header->buckets & (header->buckets - 1))
+			 && header->count < header->buckets
+			 && sizeof(*header) + header->buckets * sizeof(CARD32) + header->count * sizeof(struct ProfileIndexEntry) <= header->size)
+				profileIndex.header = header;
+			else
+				munmap((void*)header, st.st_size);
+		}
+	}
+	close(fd);
+}
+
+/// Load the configuration of the named profile from the index into config.
+static int loadIndexedConfig(const char *dir, const char *name)
+{
+	char fn[2048];
+	struct FileStamp dirStamp, defaultStamp, stamp;
+	fileStamp(dir, &dirStamp);
+	snprintf(fn, sizeof(fn), "%s/default", dir);
+	fileStamp(fn, &defaultStamp);
+
+	int result = INDEX_STALE;
+	spinLock(&profileIndex.lock);
+	const struct ProfileIndexHeader *header = profileIndex.header;
+	if (!header || !sameStamp(&header->dir, &dirStamp) || !sameStamp(&header->defaultProfile, &defaultStamp))
+	{
+		if (header)
+			munmap((void*)header, header->size);
+		profileIndex.header = NULL;
+		mapProfileIndex();
+		header = profileIndex.header;
+	}
+	if (header && sameStamp(&header->dir, &dirStamp) && sameStamp(&header->defaultProfile, &defaultStamp))
+	{
+		const CARD32 *buckets = (const CARD32*)(header + 1);
+		const struct ProfileIndexEntry *entries = (const struct ProfileIndexEntry*)(buckets + header->buckets);
+		size_t length = strlen(name);
+		CARD32 hash = hashBytes(2166136261u, name, length);
+		const struct ProfileIndexEntry *entry = &header->fallback;
+		for (CARD32 i = hash & (header->buckets - 1); buckets[i] && buckets[i] <= header->count; i = (i + 1) & (header->buckets - 1))
+		{
+			const struct ProfileIndexEntry *e = &entries[buckets[i] - 1];
+			if (e->hash == hash && e->nameLength == length
+			 && e->nameOffset + length <= header->size
+			 && !memcmp((const char*)header + e->nameOffset, name, length))
+			{
+				entry = e;
+				break;
+			}
+		}
+
+		if (entry != &header->fallback)
+		{
+			snprintf(fn, sizeof(fn), "%s/%s", dir, name);
+			fileStamp(fn, &stamp);
+		}
+		if (entry != &header->fallback && !sameStamp(&entry->stamp, &stamp))
+			result = INDEX_STALE;
+		else
+		if (entry->hasLists)
+			result = INDEX_MISS;
+		else
+		{
+			config = entry->config;
+			result = INDEX_HIT;
+		}
+	}
+	spinUnlock(&profileIndex.lock);
+	return result;
+}
+
+/// Load the named profile on top of the default one (as already loaded into
+/// base) into entry. Overwrites config.
+static void indexProfile(struct ProfileIndexEntry *entry, const struct ProfileIndexEntry *base, const char *dir, const char *name)
+{
+	char fn[2048];
+	config = base->config;
+	snprintf(fn, sizeof(fn), "%s/%s", dir, name);
+	fileStamp(fn, &entry->stamp); // before reading, so that later changes are noticed
+	readConfig(fn, true);
+	entry->hasLists = base->hasLists || config.maps || config.prefetches;
+	freeConfigLists();
+	entry->config = config;
+}
+
+/// Rebuild the index from all profiles in dir. Overwrites config.
+static void buildProfileIndex(const char *dir)
+{
+	struct ProfileIndexHeader header = { .layout = configLayout() };
+	memcpy(header.magic, PROFILE_INDEX_MAGIC, sizeof(header.magic));
+
+	char fn[2048];
+	fileStamp(dir, &header.dir); // before listing it, so that later changes are noticed
+	snprintf(fn, sizeof(fn), "%s/default", dir);
+	fileStamp(fn, &header.defaultProfile);
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	configDefaults();
+	readConfig(fn, true);
+	header.fallback.hasLists = config.maps || config.prefetches;
+	freeConfigLists();
+	header.fallback.config = config;
+
+	struct ProfileIndexEntry *entries = NULL;
+	char *names = NULL;
+	size_t namesLength = 0;
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_name[0] == '.' || (de->d_type != DT_REG && de->d_type != DT_UNKNOWN))
+			continue;
+		entries = realloc(entries, (header.count + 1) * sizeof(*entries));
+		struct ProfileIndexEntry *entry = &entries[header.count++];
+		memset(entry, 0, sizeof(*entry));
+		indexProfile(entry, &header.fallback, dir, de->d_name);
+		entry->nameLength = strlen(de->d_name);
+		entry->nameOffset = namesLength; // relative to the names, for now
+		entry->hash = hashBytes(2166136261u, de->d_name, entry->nameLength);
+		names = realloc(names, namesLength + entry->nameLength);
+		memcpy(names + namesLength, de->d_name, entry->nameLength);
+		namesLength += entry->nameLength;
+	}
+	closedir(d);
+	configDefaults();
+
+	header.buckets = 2;
+	while (header.buckets < header.count * 2)
+		header.buckets *= 2;
+	CARD32 *buckets = calloc(header.buckets, sizeof(CARD32));
+	size_t namesOffset = sizeof(header) + header.buckets * sizeof(CARD32) + header.count * sizeof(*entries);
+	for (CARD32 n = 0; n < header.count; n++)
+	{
+		entries[n].nameOffset += namesOffset;
+		CARD32 i = entries[n].hash & (header.buckets - 1);
+		while (buckets[i])
+			i = (i + 1) & (header.buckets - 1);
+		buckets[i] = n + 1;
+	}
+	header.size = namesOffset + namesLength;
+
+	// Write a new file and rename it over the old one, which processes may have mapped
+	char path[1024];
+	getProfileIndexPath(path, sizeof(path), true);
+	snprintf(fn, sizeof(fn), "%s.XXXXXX", path); // unique, also between threads
+	int fd = mkostemp(fn, O_CLOEXEC);
+	if (fd >= 0)
+	{
+		bool ok =
+			write(fd, &header, sizeof(header)) == sizeof(header) &&
+			write(fd, buckets, header.buckets * sizeof(CARD32)) == (ssize_t)(header.buckets * sizeof(CARD32)) &&
+			write(fd, entries, header.count * sizeof(*entries)) == (ssize_t)(header.count * sizeof(*entries)) &&
+			write(fd, names, namesLength) == (ssize_t)namesLength;
+		close(fd);
+		if (!ok || rename(fn, path) != 0)
+			unlink(fn);
+	}
+	free(buckets);
+	free(entries);
+	free(names);
+}
+
+// ****************************************************************************
+
+/// The profile the calling thread uses
+static void threadProfileName(char *name, size_t size)
+{
+	if (profileOverride)
+		snprintf(name, size, "%s", profileOverride);
+	else
+		getProfileName(name, size - 1);
+}
+
+static void needConfig()
+{
+	if (configLoaded)
+		return;
+	configLoaded = 1;
+	configLoadedGeneration = __atomic_load_n(&configGeneration, __ATOMIC_ACQUIRE);
 
-	strcpy(p, "/default");
-	readConfig(buf);
+	configDefaults();
 
-	getProfileName(p + 1, sizeof(buf) - (p-buf));
-	readConfig(buf);
+	char dir[1024];
+	if (!getProfilesPath(dir, sizeof(dir), false))
+		return;
+
+	char name[1024] = {0};
+	threadProfileName(name, sizeof(name));
+
+	char fn[2][2048];
+	snprintf(fn[0], sizeof(fn[0]), "%s/default", dir);
+	snprintf(fn[1], sizeof(fn[1]), "%s/%s", dir, name);
+	fileStamp(fn[0], &configStamps[0]);
+	fileStamp(fn[1], &configStamps[1]);
+
+	int index = loadIndexedConfig(dir, name);
+	if (index != INDEX_HIT)
+	{
+		getProfilesPath(dir, sizeof(dir), true);
+		if (index == INDEX_STALE)
+			buildProfileIndex(dir);
+
+		readConfig(fn[0], false);
+		readConfig(fn[1], false);
+	}
+
+	compileMaps();
+	compileRequestActions();
+	compileEventActions();
+}
+
+/// Release the calling thread's configuration (when a relay thread exits).
+static void freeConfig()
+{
+	freeConfigLists();
+	for (int kind = 0; kind < 2; kind++)
+		for (int code = 0; code < 256; code++)
+			free(mapTables[kind][code].targets);
+	memset(mapTables, 0, sizeof(mapTables));
+	memset(&config, 0, sizeof(config));
+	configLoaded = 0;
 }
 
 // ****************************************************************************
@@ -381,6 +854,10 @@ static bool fixMonitor(INT16* x, INT16* y, CARD16 *width, CARD16 *height)
 {
 	if (config.joinMST)
 	{
+		         int* mstConfigX[maxMST] = { &config.mainX, &config.mst2X, &config.mst3X, &config.mst4X };
+		         int* mstConfigY[maxMST] = { &config.mainY, &config.mst2Y, &config.mst3Y, &config.mst4Y };
+		unsigned int* mstConfigW[maxMST] = { &config.mainW, &config.mst2W, &config.mst3W, &config.mst4W };
+		unsigned int* mstConfigH[maxMST] = { &config.mainH, &config.mst2H, &config.mst3H, &config.mst4H };
 		for (int n=0; n<maxMST; n++)
 			if (*mstConfigW[n])
 			{
@@ -450,19 +927,141 @@ static void hexDump(const void* buf, size_t len, char prefix1, char prefix2)
 #include <sys/socket.h>
 
 #define ANCIL_SIZE 256
+
+/// Data accepted for one direction but not yet written to its socket.
+/// Reading from the other side pauses while this holds OUTPUT_QUEUE_LIMIT bytes or more.
+struct OutputQueue
+{
+	int fd;
+	char dir; // for logging
+	char* buf;
+	size_t start, end, size;
+};
+
+#define OUTPUT_QUEUE_LIMIT (1<<20)
+
+static size_t queued(const struct OutputQueue* queue)
+{
+	return queue->end - queue->start;
+}
+
+static bool queueFull(const struct OutputQueue* queue)
+{
+	return queued(queue) >= OUTPUT_QUEUE_LIMIT;
+}
+
+static void enqueue(struct OutputQueue* queue, const void* buf, size_t length)
+{
+	if (queue->start == queue->end)
+		queue->start = queue->end = 0;
+	if (queue->end + length > queue->size && queue->start)
+	{
+		memmove(queue->buf, queue->buf + queue->start, queued(queue));
+		queue->end -= queue->start;
+		queue->start = 0;
+	}
+	if (queue->end + length > queue->size)
+	{
+		size_t size = queue->size ? queue->size : 1<<16;
+		while (size < queue->end + length)
+			size *= 2;
+		queue->buf = realloc(queue->buf, size);
+		queue->size = size;
+	}
+	memcpy(queue->buf + queue->end, buf, length);
+	queue->end += length;
+}
+
+/// Write as much of the queue as the socket takes without blocking.
+static bool flushQueue(struct OutputQueue* queue)
+{
+	while (queued(queue))
+	{
+		ssize_t len = send(queue->fd, queue->buf + queue->start, queued(queue), MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+		{
+			log_debug("%c send returned %zd\n", queue->dir, len);
+			return false;
+		}
+		queue->start += len;
+	}
+	return true;
+}
+
 struct Connection
 {
 	int recvfd, sendfd;
 	char dir; // for logging
 
+	/// Output queues of the send side and of the opposite direction.
+	/// Both are kept draining while waiting on a socket.
+	struct OutputQueue *out, *back;
+
 	// Ancillary data buffer.
 	// Necessary to pass around file descriptors needed for DRI3.
 	char ancilBuf[ANCIL_SIZE];
 	size_t ancilRead, ancilWrite;
 };
 
+/// Wait until fd is ready for the given events, writing out both queues of
+/// the connection in the meantime.
+static bool waitFor(struct Connection* conn, int fd, short events)
+{
+	while (true)
+	{
+		struct pollfd fds[3] = {
+			{ .fd = fd, .events = events },
+			{ .fd = -1 },
+			{ .fd = -1 },
+		};
+		if (conn->out && queued(conn->out))
+			fds[1].fd = conn->out->fd, fds[1].events = POLLOUT;
+		if (conn->back && queued(conn->back))
+			fds[2].fd = conn->back->fd, fds[2].events = POLLOUT;
+
+		if (poll(fds, 3, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			log_error("poll() failed");
+			return false;
+		}
+		if (fds[1].revents && !flushQueue(conn->out)) return false;
+		if (fds[2].revents && !flushQueue(conn->back)) return false;
+		if (fds[0].revents)
+			return true;
+	}
+}
+
 static char sendAll(struct Connection* conn, const void* buf, size_t length)
 {
+	// Pairs with the fence in recvAll: state written before a message is sent
+	// (e.g. the notes for a request) is visible to the thread handling the
+	// other direction (in DuplexThreads mode) once the message's answer arrives.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	hexDump(buf, length, conn->dir, '=');
+
+	bool ancillary = conn->ancilWrite > conn->ancilRead;
+	if (conn->out && !ancillary)
+	{
+		// Queue behind whatever is still pending, and write what the socket takes now.
+		enqueue(conn->out, buf, length);
+		return flushQueue(conn->out);
+	}
+
+	// File descriptors must go out with the bytes they arrived with,
+	// so write the queue out first, then this message directly.
+	if (conn->out)
+		while (queued(conn->out))
+		{
+			if (!flushQueue(conn->out)) return 0;
+			if (queued(conn->out) && !waitFor(conn, conn->sendfd, POLLOUT)) return 0;
+		}
+
 	int remaining = length;
 	while (remaining)
 	{
@@ -479,6 +1078,11 @@ static char sendAll(struct Connection* conn, const void* buf, size_t length)
 		msg.msg_controllen = conn->ancilWrite - conn->ancilRead;
 
 		int len = sendmsg(conn->sendfd, &msg, MSG_NOSIGNAL);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if (!waitFor(conn, conn->sendfd, POLLOUT)) return 0;
+			continue;
+		}
 		if (len <= 0)
 			log_debug("%c sendmsg returned %d\n", conn->dir, len);
 		if (len <= 0)
@@ -489,9 +1093,15 @@ static char sendAll(struct Connection* conn, const void* buf, size_t length)
 		if (conn->ancilRead == conn->ancilWrite)
 			conn->ancilRead = conn->ancilWrite = 0;
 
-		hexDump(buf, len, conn->dir, '=');
 		buf += len;
 		remaining -= len;
+
+		// The descriptors are out, the rest can be queued.
+		if (remaining && conn->out)
+		{
+			enqueue(conn->out, buf, remaining);
+			return flushQueue(conn->out);
+		}
 	}
 	return 1;
 }
@@ -514,6 +1124,12 @@ static char recvAll(struct Connection* conn, void* buf, size_t length)
 		msg.msg_controllen = ANCIL_SIZE - conn->ancilWrite;
 
 		int len = recvmsg(conn->recvfd, &msg, 0);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// Rest of the message isn't here yet
+			if (!waitFor(conn, conn->recvfd, POLLIN)) return 0;
+			continue;
+		}
 		if (len <= 0)
 			log_debug("%c recvmsg returned %d\n", conn->dir, len);
 		if (len < 0)
@@ -529,149 +1145,30 @@ static char recvAll(struct Connection* conn, void* buf, size_t length)
 		buf += len;
 		remaining -= len;
 	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
 	return 1;
 }
 
+static bool readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLRDNORM };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static uint64_t monotonicNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 static size_t pad(size_t n)
 {
 	return (n+3) & ~3;
 }
 
-static const char* requestNames[256] =
-{
-	NULL, // 0
-	"CreateWindow",
-	"ChangeWindowAttributes",
-	"GetWindowAttributes",
-	"DestroyWindow",
-	"DestroySubwindows",
-	"ChangeSaveSet",
-	"ReparentWindow",
-	"MapWindow",
-	"MapSubwindows",
-	"UnmapWindow",
-	"UnmapSubwindows",
-	"ConfigureWindow",
-	"CirculateWindow",
-	"GetGeometry",
-	"QueryTree",
-	"InternAtom",
-	"GetAtomName",
-	"ChangeProperty",
-	"DeleteProperty",
-	"GetProperty",
-	"ListProperties",
-	"SetSelectionOwner",
-	"GetSelectionOwner",
-	"ConvertSelection",
-	"SendEvent",
-	"GrabPointer",
-	"UngrabPointer",
-	"GrabButton",
-	"UngrabButton",
-	"ChangeActivePointerGrab",
-	"GrabKeyboard",
-	"UngrabKeyboard",
-	"GrabKey",
-	"UngrabKey",
-	"AllowEvents",
-	"GrabServer",
-	"UngrabServer",
-	"QueryPointer",
-	"GetMotionEvents",
-	"TranslateCoords",
-	"WarpPointer",
-	"SetInputFocus",
-	"GetInputFocus",
-	"QueryKeymap",
-	"OpenFont",
-	"CloseFont",
-	"QueryFont",
-	"QueryTextExtents",
-	"ListFonts",
-	"ListFontsWithInfo",
-	"SetFontPath",
-	"GetFontPath",
-	"CreatePixmap",
-	"FreePixmap",
-	"CreateGC",
-	"ChangeGC",
-	"CopyGC",
-	"SetDashes",
-	"SetClipRectangles",
-	"FreeGC",
-	"ClearArea",
-	"CopyArea",
-	"CopyPlane",
-	"PolyPoint",
-	"PolyLine",
-	"PolySegment",
-	"PolyRectangle",
-	"PolyArc",
-	"FillPoly",
-	"PolyFillRectangle",
-	"PolyFillArc",
-	"PutImage",
-	"GetImage",
-	"PolyText8",
-	"PolyText16",
-	"ImageText8",
-	"ImageText16",
-	"CreateColormap",
-	"FreeColormap",
-	"CopyColormapAndFree",
-	"InstallColormap",
-	"UninstallColormap",
-	"ListInstalledColormaps",
-	"AllocColor",
-	"AllocNamedColor",
-	"AllocColorCells",
-	"AllocColorPlanes",
-	"FreeColors",
-	"StoreColors",
-	"StoreNamedColor",
-	"QueryColors",
-	"LookupColor",
-	"CreateCursor",
-	"CreateGlyphCursor",
-	"FreeCursor",
-	"RecolorCursor",
-	"QueryBestSize",
-	"QueryExtension",
-	"ListExtensions",
-	"ChangeKeyboardMapping",
-	"GetKeyboardMapping",
-	"ChangeKeyboardControl",
-	"GetKeyboardControl",
-	"Bell",
-	"ChangePointerControl",
-	"GetPointerControl",
-	"SetScreenSaver",
-	"GetScreenSaver",
-	"ChangeHosts",
-	"ListHosts",
-	"SetAccessControl",
-	"SetCloseDownMode",
-	"KillClient",
-	"RotateProperties",
-	"ForceScreenSaver",
-	"SetPointerMapping",
-	"GetPointerMapping",
-	"SetModifierMapping",
-	"GetModifierMapping",
-	NULL, // 120
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	"NoOperation", // 127
-	// from this point on the opcodes are dynamically assigned to extensions.
-	// you can see their names with "xdpyinfo -queryExt | grep opcode"
-	// https://www.x.org/wiki/Development/Documentation/Protocol/OpCodes/
-	NULL,
-};
+// requestNames, requestSizes and the extension minor opcode names
+#include "protocol.h"
 
 static const char *responseNames[256] =
 {
@@ -757,12 +1254,31 @@ typedef struct
 	/// Number of this X server connection for this process
 	int index;
 
+	/// X display number this connection goes to (scope for per-display caches)
+	int display;
+
+	/// Hash of the X server vendor, release and screen setup (scope for persistent caches)
+	CARD32 setupHash;
+
+	/// Resource IDs allocated to the client
+	CARD32 ridBase, ridMask;
+
+	/// Root windows, as received in the connection setup
+	int numRoots;
+	Window roots[4];
+	CARD8 rootDepths[4];
+
 	/// Sockets for the connection to the X server (Xorg) and client (host application)
 	int server, client;
 
-	/// Reusable data buffer
-	unsigned char *buf;
-	size_t bufLen;
+
+	/// Profile of the application, if it is not this process (daemon)
+	char profile[256];
+	bool received; // taken over by receiveConnection
+
+	/// Reusable data buffers for requests and for server data
+	unsigned char *buf, *serverBuf;
+	size_t bufLen, serverBufLen;
 
 	/// Connection prefix received and sent
 	bool clientInitialized, serverInitialized;
@@ -775,6 +1291,9 @@ typedef struct
 	unsigned char opcode_RANDR;
 	unsigned char opcode_Xinerama;
 	unsigned char opcode_NV_GLX;
+	unsigned char opcode_XKEYBOARD;
+	unsigned char event_XKEYBOARD;
+	unsigned char opcode_GLX;
 
 	/// Learned atoms, as returned by InternAtom
 	CARD32 atom__NET_ACTIVE_WINDOW;
@@ -785,6 +1304,78 @@ typedef struct
 	CARD16 serialDelta;
 	unsigned char skip[1<<16];
 	Window grabWindow;
+
+	/// Local answering of requests (see injectReply)
+	CARD16 clientSerial; // The serial of the last request received from the client
+	CARD16 answered[1<<16]; // Client requests answered locally before this server serial
+	bool replyPending; // A forwarded request may still produce a reply
+	CARD16 serialReplyPending; // The serial of that request
+	CARD16 serialComplete; // The serial of the last reply or error received
+	struct HeldReplies *heldHead, *heldTail; // Local replies waiting for the server (see injectReplies)
+
+	/// Requests whose replies are to be stored in a cache, in serial order
+	struct PendingStore *storeHead, *storeTail;
+
+	/// Fonts opened by the client (for CacheFonts)
+	struct FontName *fonts;
+	bool fontPathChecked;
+
+	/// The client's windows, hashed by ID (for MirrorGeometry and event mask tracking)
+	struct WindowInfo *windows[256];
+
+	/// Pointer state tracking (for TrackPointer)
+	struct { CARD16 serial; Window window; } pointerQueries[64]; // Forwarded QueryPointer requests (Note_X_QueryPointer), by serial modulo 64
+	Window pointerWindow; // The window whose pointer state we track
+	bool pointerMaskKnown; // pointerClientMask is valid
+	bool pointerUsable; // The events we receive for pointerWindow are enough to follow the pointer
+	bool pointerValid; // pointer is up to date
+	bool pointerGrabbed; // The client grabbed the pointer in a way that may hide pointer events from us
+	CARD32 pointerClientMask; // Event mask selected by the client on pointerWindow
+	CARD32 pointerAddedMask; // Event mask bits we added on pointerWindow
+	xQueryPointerReply pointer;
+
+	/// Root window properties (for CacheRootProperties)
+	struct ReplyCache *propertyCache; // scope is the window, tag the property atom
+	CARD32 rootEventMasks[4]; // As selected by the client
+	struct { CARD16 serial; CARD8 root; } rootQueries[64]; // GetWindowAttributes on a root (Note_X_GetWindowAttributes_Root), by serial modulo 64
+
+	/// Replies requested on connection setup (for Prefetch)
+	struct Prefetched *prefetched;
+	int prefetchPending;
+
+	/// Statistics (for CompressMotion and CompressConfigure)
+	unsigned long motionEvents, motionMerged;
+	unsigned long configureEvents, configureMerged;
+	unsigned long exposeEvents, exposeMerged;
+
+	/// A ConfigureWindow request to be merged into the next one (for CoalesceConfigure)
+	Window heldConfigureWindow;
+	CARD16 heldConfigureMask;
+	CARD32 heldConfigureValues[7];
+
+	/// Mapped keys and buttons being held down, indexed like mapTables (for Map)
+	unsigned char mappedDown[2][256 / 8];
+	int mappedHeld; // bits set in mappedDown
+
+	/// Data waiting to be written to each side
+	struct OutputQueue toServer, toClient;
+
+	/// Each direction is relayed by its own thread (DuplexThreads)
+	bool duplex;
+	int threads; // still running
+
+	/// A large request is being passed through in slices; requests injected
+	/// in the meantime are held until it is complete
+	bool streaming;
+	struct OutputQueue heldRequests;
+	unsigned char* slice;
+	size_t sliceLen;
+
+	/// Event latency statistics (logged on exit with Debug>=1), measured from
+	/// the last time the relay found the server socket idle
+	uint64_t serverReadyAt;
+	unsigned long latencyEvents;
+	uint64_t latencyTotal, latencyMax;
 } X11ConnData;
 
 enum
@@ -797,6 +1388,8 @@ enum
 	Note_X_QueryExtension_RANDR,
 	Note_X_QueryExtension_Xinerama,
 	Note_X_QueryExtension_NV_GLX,
+	Note_X_QueryExtension_XKEYBOARD,
+	Note_X_QueryExtension_GLX,
 	Note_X_QueryExtension_Other,
 	Note_X_XF86VidModeGetModeLine,
 	Note_X_XF86VidModeGetAllModeLines,
@@ -806,9 +1399,39 @@ enum
 	Note_X_RRGetScreenResourcesCurrent,
 	Note_X_XineramaQueryScreens,
 	Note_X_GrabPointer,
+	Note_X_GetFontPath,
+	Note_X_ListFontsWithInfo,
+	Note_X_QueryPointer,
+	Note_X_GetWindowAttributes_Pointer,
+	Note_X_GetWindowAttributes_Root,
+	Note_X_QueryTree_Pointer,
 	Note_NV_GLX,
 };
 
+/// The core request each note is for, to check the size of its reply against
+/// replySizes before looking inside
+static const CARD8 noteRequests[] =
+{
+	[Note_X_GetGeometry] = X_GetGeometry,
+	[Note_X_InternAtom__NET_ACTIVE_WINDOW] = X_InternAtom,
+	[Note_X_InternAtom_Other] = X_InternAtom,
+	[Note_X_QueryExtension_XFree86_VidModeExtension] = X_QueryExtension,
+	[Note_X_QueryExtension_RANDR] = X_QueryExtension,
+	[Note_X_QueryExtension_Xinerama] = X_QueryExtension,
+	[Note_X_QueryExtension_NV_GLX] = X_QueryExtension,
+	[Note_X_QueryExtension_XKEYBOARD] = X_QueryExtension,
+	[Note_X_QueryExtension_GLX] = X_QueryExtension,
+	[Note_X_QueryExtension_Other] = X_QueryExtension,
+	[Note_X_GrabPointer] = X_GrabPointer,
+	[Note_X_GetFontPath] = X_GetFontPath,
+	[Note_X_ListFontsWithInfo] = X_ListFontsWithInfo,
+	[Note_X_QueryPointer] = X_QueryPointer,
+	[Note_X_GetWindowAttributes_Pointer] = X_GetWindowAttributes,
+	[Note_X_GetWindowAttributes_Root] = X_GetWindowAttributes,
+	[Note_X_QueryTree_Pointer] = X_QueryTree,
+	[Note_NV_GLX] = 0, // extension replies are not checked; this sizes the table for all notes
+};
+
 // definition stolen from libX11/src/Xatomtype.h
 typedef struct {
     CARD32 flags;
@@ -869,69 +1492,1572 @@ static void logXReply(X11ConnData *data, const char* name, const xReply* reply,
 	}
 }
 
+// Names an extension request as "Extension:Minor", for the extensions whose
+// major opcode we have learned from QueryExtension.
+static const char* extensionRequestName(X11ConnData *data, const xReq* req, char* buf, size_t size)
+{
+	const char* extension = NULL;
+	const char* const* minorNames = NULL;
+	if (req->reqType == data->opcode_XFree86_VidModeExtension)
+		extension = "XF86VidMode", minorNames = xf86VidModeRequestNames;
+	else
+	if (req->reqType == data->opcode_RANDR)
+		extension = "RANDR", minorNames = randrRequestNames;
+	else
+	if (req->reqType == data->opcode_Xinerama)
+		extension = "XINERAMA", minorNames = xineramaRequestNames;
+	else
+	if (req->reqType == data->opcode_NV_GLX)
+		extension = "NV-GLX";
+	else
+	if (req->reqType == data->opcode_XKEYBOARD)
+		extension = "XKEYBOARD", minorNames = xkbRequestNames;
+	else
+	if (req->reqType == data->opcode_GLX)
+		extension = "GLX", minorNames = glxRequestNames;
+	else
+		return "*DYN_OP*";
+
+	const char* minorName = minorNames ? minorNames[req->data] : NULL;
+	if (minorName)
+		snprintf(buf, size, "%s:%s", extension, minorName);
+	else
+		snprintf(buf, size, "%s:%d", extension, req->data);
+	return buf;
+}
+
 static void logXReq(X11ConnData *data, const char* name, const xReq* req, size_t length, CARD16 sequenceNumber)
 {
+	if (config.debug < 2)
+		return;
+
 	// https://www.x.org/releases/current/doc/xproto/x11protocol.html#request_format
 	// Major opcodes 128 through 255 are reserved for extensions
 	bool isDynamicOp = (req->reqType & 0x80) != 0;
 
-	// TODO: catch those dynamic opcode names
-	const char* reqName = isDynamicOp ? "*DYN_OP*" : requestNames[req->reqType & 0x7f];
+	char extName[64];
+	const char* reqName = isDynamicOp ? extensionRequestName(data, req, extName, sizeof(extName)) : requestNames[req->reqType & 0x7f];
 
 	log_debug2("[%d][%d] %s: %d (%s) with data %d, length=%zu\n",
 			   data->index, sequenceNumber, name, req->reqType, reqName, req->data, length);
 	/* log_debug2("  [server: %d] <- [client: %d]\n", sequenceNumber, sequenceNumber - data->serialDelta); */
 }
 
+static void relayConnection(X11ConnData *data, struct Connection* conn, bool toServer, char dir)
+{
+	conn->recvfd = toServer ? data->client : data->server;
+	conn->sendfd = toServer ? data->server : data->client;
+	conn->dir = dir;
+	conn->out = toServer ? &data->toServer : &data->toClient;
+	// In DuplexThreads mode, the other direction's queue belongs to the other thread
+	conn->back = data->duplex ? NULL : toServer ? &data->toClient : &data->toServer;
+}
+
 static CARD16 injectRequest(X11ConnData *data, void* buf, size_t size)
 {
 	struct Connection conn = {};
-	conn.recvfd = data->client;
-	conn.sendfd = data->server;
-	conn.dir = '{';
+	relayConnection(data, &conn, true, '{');
 
 	const xReq* req = (xReq*)buf;
-	sendAll(&conn, req, size);
+	if (data->streaming)
+		enqueue(&data->heldRequests, req, size); // can't interleave with the request being passed through
+	else
+		sendAll(&conn, req, size);
 	CARD16 sequenceNumber = ++data->serial;
 	data->skip[sequenceNumber] = true;
 	logXReq(data, "Injected request", req, size, sequenceNumber);
 	return sequenceNumber;
 }
 
-static CARD16 injectReply(X11ConnData *data, void* buf, size_t size)
+// Accounts for the client's current request not being forwarded to the server.
+static void dropRequest(X11ConnData *data)
+{
+	// The server will never see this request, so it does not get a server serial.
+	// Replies and events from the next forwarded request on are one serial
+	// closer to the client's numbering (applied in handleServerData).
+	data->serial--;
+	data->answered[(CARD16)(data->serial + 1)]++;
+}
+
+/// Local replies held until the server has processed a request injected after
+/// the last one forwarded before them.
+struct HeldReplies
+{
+	struct HeldReplies *next;
+	CARD16 sync; // the serial of that request
+	unsigned char *buf;
+	size_t size;
+};
+
+/// Send the local replies which were waiting for the request with this serial.
+static void sendHeldReplies(X11ConnData *data, CARD16 serial)
 {
 	struct Connection conn = {};
-	conn.recvfd = data->server;
-	conn.sendfd = data->client;
-	conn.dir = '}';
+	relayConnection(data, &conn, false, '}');
 
-	xReply* reply = (xReply*)buf;
-	reply->generic.sequenceNumber = data->serial - data->serialDelta--;
-	reply->generic.length = ((size < sz_xReply ? sz_xReply : size) - sz_xReply + 3) / 4;
-	sendAll(&conn, reply, size);
-	logXReply(data, "Injected reply", reply, size);
-	return reply->generic.sequenceNumber;
+	while (data->heldHead && data->heldHead->sync == serial)
+	{
+		struct HeldReplies *held = data->heldHead;
+		log_debug2("  Sending %zu bytes of held local replies\n", held->size);
+		sendAll(&conn, held->buf, held->size);
+		data->heldHead = held->next;
+		if (!data->heldHead)
+			data->heldTail = NULL;
+		free(held->buf);
+		free(held);
+	}
 }
 
-static void injectEvent(X11ConnData *data, xEvent* event)
+// Answers the client's current request locally, instead of forwarding it to the server.
+// buf holds one or more complete replies (more for e.g. ListFontsWithInfo).
+// Errors and events for the requests forwarded before this one must reach the
+// client first, as they carry older serials. Unless all of those requests are
+// known to be done, the replies are held until the server has answered a
+// GetInputFocus injected after them.
+static CARD16 injectReplies(X11ConnData *data, void* buf, size_t size)
 {
 	struct Connection conn = {};
-	conn.recvfd = data->server;
-	conn.sendfd = data->client;
-	conn.dir = '}';
-	size_t size = sizeof(xEvent);
-	sendAll(&conn, event, size);
-	logXReply(data, "Injected event", (const xReply *) event, size);
+	relayConnection(data, &conn, false, '}');
+
+	for (size_t ofs = 0; ofs < size; )
+	{
+		xReply* reply = (xReply*)(buf + ofs);
+		size_t replySize = sz_xReply + reply->generic.length * 4;
+		reply->generic.sequenceNumber = data->clientSerial;
+		logXReply(data, "Injected reply", reply, replySize);
+		ofs += replySize;
+	}
+
+	dropRequest(data);
+	if (!data->heldHead && !data->replyPending && data->serialComplete == data->serial)
+	{
+		sendAll(&conn, buf, size);
+		return data->clientSerial;
+	}
+
+	if (!data->heldTail || data->heldTail->sync != data->serial) // something was sent to the server since
+	{
+		xReq req = {};
+		req.reqType = X_GetInputFocus;
+		req.length = sizeof(req)/4;
+		struct HeldReplies *held = calloc(1, sizeof(struct HeldReplies));
+		held->sync = injectRequest(data, &req, sizeof(req));
+		if (data->heldTail)
+			data->heldTail->next = held;
+		else
+			data->heldHead = held;
+		data->heldTail = held;
+	}
+
+	struct HeldReplies *held = data->heldTail;
+	held->buf = realloc(held->buf, held->size + size);
+	memcpy(held->buf + held->size, buf, size);
+	held->size += size;
+	log_debug2("  Holding the reply until the server answers request %d\n", held->sync);
+	return data->clientSerial;
 }
 
-static void grabPointer(X11ConnData* data, Window window)
+static CARD16 injectReply(X11ConnData *data, void* buf, size_t size)
+{
+	xReply* reply = (xReply*)buf;
+	reply->generic.length = ((size < sz_xReply ? sz_xReply : size) - sz_xReply + 3) / 4;
+	return injectReplies(data, buf, size);
+}
+
+static void injectEvents(X11ConnData *data, xEvent* events, size_t count)
+{
+	struct Connection conn = {};
+	relayConnection(data, &conn, false, '}');
+	for (size_t i = 0; i < count; i++)
+		logXReply(data, "Injected event", (const xReply *) &events[i], sizeof(xEvent));
+	sendAll(&conn, events, count * sizeof(xEvent));
+}
+
+static void selectEvents(X11ConnData *data, Window window, CARD32 mask)
+{
+	struct {
+		xChangeWindowAttributesReq req;
+		CARD32 eventMask;
+	} req = {};
+	req.req.reqType = X_ChangeWindowAttributes;
+	req.req.length = sizeof(req)/4;
+	req.req.window = window;
+	req.req.valueMask = CWEventMask;
+	req.eventMask = mask;
+	injectRequest(data, &req, sizeof(req));
+}
+
+// ****************************************************************************
+
+// Reply caches: requests whose replies are expected to stay the same
+// can be answered locally (with injectReply) the next time they are seen.
+// Replies are stored as received from the server, so only requests whose
+// replies hax11 does not rewrite should be cached.
+// Named caches are persisted under ~/.cache/hax11/, and thus shared by all
+// processes; use X11ConnData::setupHash as their scope.
+
+struct CacheEntry
+{
+	struct CacheEntry *next;
+	CARD32 scope; // entries only match within the same scope (e.g. X display)
+	CARD32 tag; // for selective invalidation (see cacheInvalidate)
+	size_t keyLength, replyLength;
+	unsigned char data[]; // the request, followed by the reply
+};
+
+struct ReplyCache
+{
+	const char *name; // file name, if persisted
+	volatile char lock;
+	bool loaded;
+	unsigned int generation; // incremented on every invalidation
+	struct CacheEntry *entries;
+};
+
+/// On-disk format of a cache entry, followed by the key and reply
+struct CacheRecord
+{
+	CARD32 scope, tag, keyLength, replyLength;
+};
+
+/// A forwarded request whose reply is to be stored in a cache.
+struct PendingStore
+{
+	struct PendingStore *next;
+	CARD16 serial;
+	bool multi; // more replies follow until one with a zero data1 byte (ListFontsWithInfo)
+	struct ReplyCache *cache;
+	unsigned int generation;
+	CARD32 scope, tag;
+	unsigned char *reply;
+	size_t replyLength;
+	size_t keyLength;
+	unsigned char key[];
+};
+
+/// XKB and core keyboard mapping replies (CacheKeymap). Shared by all connections.
+static struct ReplyCache keymapCache;
+
+/// GLX server strings and visual/FBConfig lists (CacheGLX)
+static struct ReplyCache glxCache = { .name = "glx" };
+
+/// Core font lists and metrics (CacheFonts).
+/// Valid only for the font path stored in it under the GetFontPath request.
+static struct ReplyCache fontCache = { .name = "fonts" };
+
+static struct CacheEntry **cacheFind(struct ReplyCache *cache, CARD32 scope, const void *key, size_t keyLength)
+{
+	struct CacheEntry **p;
+	for (p = &cache->entries; *p; p = &(*p)->next)
+		if ((*p)->scope == scope && (*p)->keyLength == keyLength && !memcmp((*p)->data, key, keyLength))
+			break;
+	return p;
+}
+
+static bool getCachePath(char *buf, size_t size, const char *name)
+{
+	char *home = getenv("HOME");
+	if (!home || strlen(home) + strlen(name) + 32 > size)
+		return false;
+	strcpy(buf, home);
+	strcat(buf, "/.cache"); mkdir(buf, 0700); // TODO: XDG_CACHE_HOME
+	strcat(buf, "/hax11"); mkdir(buf, 0700);
+	strcat(buf, "/");
+	strcat(buf, name);
+	return true;
+}
+
+/// Returns true if the entry replaced one with the same key.
+static bool cacheInsert(struct ReplyCache *cache, struct CacheEntry *entry)
+{
+	struct CacheEntry **p = cacheFind(cache, entry->scope, entry->data, entry->keyLength);
+	bool replaced = *p != NULL;
+	if (replaced)
+	{
+		struct CacheEntry *old = *p;
+		*p = old->next;
+		free(old);
+	}
+	entry->next = cache->entries;
+	cache->entries = entry;
+	return replaced;
+}
+
+/// Records to write to a cache's file. Prepared with the lock held, and
+/// written (by cacheWrite) after releasing it, so that other threads don't
+/// spin while this one waits for the disk or another process.
+struct CacheWrite
+{
+	unsigned char *buf;
+	size_t size;
+	bool append; // otherwise, replaces the whole file
+	unsigned int generation; // of the cache, as of buf
+};
+
+// Called with the lock held. Prepares appending the entry, or rewriting the entire file if entry is NULL.
+static void cacheSerialize(const struct ReplyCache *cache, const struct CacheEntry *entry, struct CacheWrite *w)
+{
+	if (!cache->name)
+		return;
+
+	w->size = 0;
+	for (const struct CacheEntry *e = entry ? entry : cache->entries; e; e = entry ? NULL : e->next)
+		w->size += sizeof(struct CacheRecord) + e->keyLength + e->replyLength;
+	w->buf = malloc(w->size ? w->size : 1);
+	w->append = entry != NULL;
+	w->generation = cache->generation;
+
+	unsigned char *p = w->buf;
+	for (const struct CacheEntry *e = entry ? entry : cache->entries; e; e = entry ? NULL : e->next)
+	{
+		struct CacheRecord *record = (struct CacheRecord*)p;
+		record->scope = e->scope;
+		record->tag = e->tag;
+		record->keyLength = e->keyLength;
+		record->replyLength = e->replyLength;
+		memcpy(p + sizeof(struct CacheRecord), e->data, e->keyLength + e->replyLength);
+		p += sizeof(struct CacheRecord) + e->keyLength + e->replyLength;
+	}
+}
+
+// Called without the lock held.
+static void cacheWrite(struct ReplyCache *cache, struct CacheWrite *w)
+{
+	if (!w->buf)
+		return;
+
+	char fn[1024];
+	int fd = -1;
+	if (getCachePath(fn, sizeof(fn), cache->name))
+		fd = open(fn, O_WRONLY | O_CREAT | O_CLOEXEC | (w->append ? O_APPEND : 0), 0600);
+	if (fd >= 0)
+	{
+		flock(fd, LOCK_EX); // other threads and processes may be writing to the same file
+
+		// An invalidation since w was prepared has rewritten the file or is
+		// about to; writing w now could bring back what it removed.
+		spinLock(&cache->lock);
+		bool current = cache->generation == w->generation;
+		spinUnlock(&cache->lock);
+
+		if (current)
+		{
+			if ((!w->append && ftruncate(fd, 0) != 0) || write(fd, w->buf, w->size) != (ssize_t)w->size)
+				log_debug("Error writing to %s\n", fn);
+		}
+		close(fd);
+	}
+	free(w->buf);
+	w->buf = NULL;
+}
+
+// Called with the lock held. Records appended by several processes may
+// hold the same key; if so, compact prepares rewriting the file without them.
+static void cacheLoad(struct ReplyCache *cache, struct CacheWrite *compact)
+{
+	if (cache->loaded)
+		return;
+	cache->loaded = true;
+	if (!cache->name)
+		return;
+
+	char fn[1024];
+	if (!getCachePath(fn, sizeof(fn), cache->name))
+		return;
+	FILE* f = fopen(fn, "rb");
+	if (!f)
+		return;
+
+	int count = 0, duplicates = 0;
+	struct CacheRecord record;
+	while (fread(&record, sizeof(record), 1, f) == 1)
+	{
+		if (record.keyLength > 1<<24 || record.replyLength > 1<<24)
+			break; // corrupt
+		struct CacheEntry *entry = malloc(sizeof(struct CacheEntry) + record.keyLength + record.replyLength);
+		entry->scope = record.scope;
+		entry->tag = record.tag;
+		entry->keyLength = record.keyLength;
+		entry->replyLength = record.replyLength;
+		if (fread(entry->data, 1, record.keyLength + record.replyLength, f) != record.keyLength + record.replyLength)
+		{
+			free(entry);
+			break; // truncated
+		}
+		if (cacheInsert(cache, entry))
+			duplicates++;
+		else
+			count++;
+	}
+	fclose(f);
+	log_debug("Loaded %d entries from %s\n", count, fn);
+
+	if (duplicates && compact)
+	{
+		log_debug("Compacting %s (%d duplicate entries)\n", fn, duplicates);
+		cacheSerialize(cache, NULL, compact);
+	}
+}
+
+static void cacheStore(struct ReplyCache *cache, unsigned int generation, CARD32 scope, CARD32 tag,
+	const void *key, size_t keyLength, const void *reply, size_t replyLength)
+{
+	struct CacheEntry *entry = malloc(sizeof(struct CacheEntry) + keyLength + replyLength);
+	entry->scope = scope;
+	entry->tag = tag;
+	entry->keyLength = keyLength;
+	entry->replyLength = replyLength;
+	memcpy(entry->data, key, keyLength);
+	memcpy(entry->data + keyLength, reply, replyLength);
+
+	spinLock(&cache->lock);
+	if (cache->generation != generation) // invalidated while the request was in flight
+	{
+		spinUnlock(&cache->lock);
+		free(entry);
+		return;
+	}
+	cacheInsert(cache, entry);
+	struct CacheWrite w = {};
+	cacheSerialize(cache, entry, &w);
+	spinUnlock(&cache->lock);
+	cacheWrite(cache, &w);
+}
+
+/// Remove all entries with the given scope and tag (0 matches any).
+static void cacheInvalidate(struct ReplyCache *cache, CARD32 scope, CARD32 tag)
+{
+	spinLock(&cache->lock);
+	cacheLoad(cache, NULL); // rewritten below anyway
+	cache->generation++;
+	struct CacheEntry **p = &cache->entries;
+	while (*p)
+	{
+		struct CacheEntry *entry = *p;
+		if ((!scope || entry->scope == scope) && (!tag || entry->tag == tag))
+		{
+			*p = entry->next;
+			free(entry);
+		}
+		else
+			p = &entry->next;
+	}
+	struct CacheWrite w = {};
+	cacheSerialize(cache, NULL, &w);
+	spinUnlock(&cache->lock);
+	cacheWrite(cache, &w);
+}
+
+/// Free a cache which is no longer used (e.g. one owned by a connection).
+static void cacheFree(struct ReplyCache *cache)
+{
+	while (cache->entries)
+	{
+		struct CacheEntry *next = cache->entries->next;
+		free(cache->entries);
+		cache->entries = next;
+	}
+	free(cache);
+}
+
+/// Answer the client's current request from the cache, if possible.
+/// Otherwise, arrange for the server's reply to be stored in the cache.
+/// The key is usually the request itself (in data->buf).
+static bool cacheAnswer(X11ConnData *data, struct ReplyCache *cache, CARD32 scope, CARD32 tag,
+	const void *key, size_t keyLength, CARD16 sequenceNumber)
+{
+	struct CacheWrite compact = {};
+	spinLock(&cache->lock);
+	cacheLoad(cache, &compact);
+	unsigned int generation = cache->generation;
+	struct CacheEntry *entry = *cacheFind(cache, scope, key, keyLength);
+	if (entry)
+	{
+		bufSize(&data->buf, &data->bufLen, entry->replyLength);
+		memcpy(data->buf, entry->data + entry->keyLength, entry->replyLength);
+		size_t replyLength = entry->replyLength;
+		spinUnlock(&cache->lock);
+		cacheWrite(cache, &compact);
+
+		log_debug2(" Answering from cache\n");
+		injectReplies(data, data->buf, replyLength);
+		return true;
+	}
+	spinUnlock(&cache->lock);
+	cacheWrite(cache, &compact);
+
+	struct PendingStore *store = malloc(sizeof(struct PendingStore) + keyLength);
+	store->next = NULL;
+	store->serial = sequenceNumber;
+	store->multi = ((xReq*)data->buf)->reqType == X_ListFontsWithInfo;
+	store->cache = cache;
+	store->generation = generation;
+	store->scope = scope;
+	store->tag = tag;
+	store->reply = NULL;
+	store->replyLength = 0;
+	store->keyLength = keyLength;
+	memcpy(store->key, key, keyLength);
+	if (data->storeTail)
+		data->storeTail->next = store;
+	else
+		data->storeHead = store;
+	data->storeTail = store;
+	return false;
+}
+
+/// Called for every reply and error from the server, before any rewriting.
+static void cacheComplete(X11ConnData *data, const xReply *reply, size_t length)
+{
+	CARD16 serial = reply->generic.sequenceNumber;
+	while (data->storeHead)
+	{
+		struct PendingStore *store = data->storeHead;
+		if (store->serial != serial && (CARD16)(store->serial - serial) < 0x8000)
+			break; // still in flight
+
+		if (store->serial == serial && reply->generic.type == X_Reply)
+		{
+			store->reply = realloc(store->reply, store->replyLength + length);
+			memcpy(store->reply + store->replyLength, reply, length);
+			store->replyLength += length;
+			if (store->multi && reply->generic.data1 != 0)
+				break; // wait for the rest
+			cacheStore(store->cache, store->generation, store->scope, store->tag,
+				store->key, store->keyLength, store->reply, store->replyLength);
+		}
+
+		data->storeHead = store->next;
+		if (!data->storeHead)
+			data->storeTail = NULL;
+		free(store->reply);
+		free(store);
+	}
+}
+
+// Fonts are cached by name, as font IDs are allocated by each client.
+struct FontName
+{
+	struct FontName *next;
+	Font fid;
+	CARD16 serial; // of the OpenFont request (see forgetFailedFont)
+	size_t keyLength;
+	unsigned char key[]; // a QueryFont request header, followed by the font name
+};
+
+static void rememberFont(X11ConnData *data, Font fid, CARD16 serial, const char *name, size_t length)
+{
+	struct FontName *font = malloc(sizeof(struct FontName) + sz_xReq + length);
+	font->fid = fid;
+	font->serial = serial;
+	font->keyLength = sz_xReq + length;
+	xReq *key = (xReq*)font->key;
+	key->reqType = X_QueryFont;
+	key->data = 0;
+	key->length = 0;
+	memcpy(font->key + sz_xReq, name, length);
+	font->next = data->fonts;
+	data->fonts = font;
+}
+
+static struct FontName **findFont(X11ConnData *data, Font fid)
+{
+	struct FontName **p;
+	for (p = &data->fonts; *p; p = &(*p)->next)
+		if ((*p)->fid == fid)
+			break;
+	return p;
+}
+
+static void forgetFont(X11ConnData *data, Font fid)
+{
+	struct FontName **p = findFont(data, fid);
+	if (*p)
+	{
+		struct FontName *font = *p;
+		*p = font->next;
+		free(font);
+	}
+}
+
+/// OpenFont has no reply, so fonts are remembered when it is sent, and
+/// forgotten again if the server rejects it (e.g. an unknown name, or a
+/// font ID that is in use). Otherwise the cache would answer QueryFont for
+/// a font the server does not have.
+static void forgetFailedFont(X11ConnData *data, CARD16 serial)
+{
+	for (struct FontName **p = &data->fonts; *p; p = &(*p)->next)
+		if ((*p)->serial == serial)
+		{
+			struct FontName *font = *p;
+			log_debug2("  Forgetting font 0x%lx, which failed to open\n", font->fid);
+			*p = font->next;
+			free(font);
+			break;
+		}
+}
+
+// The font cache is only used once the font path is known to match the one it was built with.
+static void requestFontPath(X11ConnData *data)
+{
+	xReq req = {};
+	req.reqType = X_GetFontPath;
+	req.length = sizeof(req)/4;
+	CARD16 serial = injectRequest(data, &req, sizeof(req));
+	data->notes[serial] = Note_X_GetFontPath;
+	data->fontPathChecked = false;
+}
+
+/// What the font cache depends on: the font path reply, followed by the
+/// stamps of the path's local directories, which change when fonts are
+/// installed or removed. Returns a malloc'd buffer.
+static unsigned char *fontPathState(const xReply *reply, size_t length, size_t *stateLength)
+{
+	const xGetFontPathReply *r = (const xGetFontPathReply*)reply;
+	unsigned char *state = malloc(length + r->nPaths * sizeof(struct FileStamp));
+	memcpy(state, reply, length);
+	*stateLength = length;
+
+	size_t ofs = sz_xGetFontPathReply;
+	for (int i = 0; i < r->nPaths && ofs < length; i++)
+	{
+		size_t n = ((const unsigned char*)reply)[ofs++];
+		if (ofs + n > length)
+			break;
+		char path[256];
+		memcpy(path, (const char*)reply + ofs, n);
+		path[n] = 0;
+		ofs += n;
+
+		char *dir = path;
+		if (!strncmp(dir, "catalogue:", 10))
+			dir += 10;
+		char *attributes = strchr(dir, ':'); // e.g. /usr/share/fonts/X11/misc:unscaled
+		if (attributes)
+			*attributes = 0;
+		if (dir[0] != '/')
+			continue; // built-ins, or a font server
+
+		struct FileStamp stamp;
+		fileStamp(dir, &stamp);
+		memcpy(state + *stateLength, &stamp, sizeof(stamp));
+		*stateLength += sizeof(stamp);
+	}
+	return state;
+}
+
+static void checkFontPath(X11ConnData *data, const xReply *reply, size_t length)
+{
+	xReq key = {};
+	key.reqType = X_GetFontPath;
+	size_t stateLength;
+	unsigned char *state = fontPathState(reply, length, &stateLength);
+
+	struct CacheWrite compact = {};
+	spinLock(&fontCache.lock);
+	cacheLoad(&fontCache, &compact);
+	struct CacheEntry *entry = *cacheFind(&fontCache, data->setupHash, &key, sizeof(key));
+	bool same = entry
+		&& entry->replyLength == stateLength
+		&& !memcmp(entry->data + entry->keyLength + 4, state + 4, stateLength - 4); // skip the serial
+	spinUnlock(&fontCache.lock);
+	cacheWrite(&fontCache, &compact);
+
+	if (!same)
+	{
+		log_debug("Font path changed, invalidating font cache\n");
+		cacheInvalidate(&fontCache, data->setupHash, 0);
+		spinLock(&fontCache.lock);
+		unsigned int generation = fontCache.generation;
+		spinUnlock(&fontCache.lock);
+		cacheStore(&fontCache, generation, data->setupHash, 0, &key, sizeof(key), state, stateLength);
+	}
+	free(state);
+	data->fontPathChecked = true;
+}
+
+static bool requestHasReply(CARD8 reqType)
+{
+	switch (reqType)
+	{
+		case X_GetWindowAttributes:
+		case X_GetGeometry:
+		case X_QueryTree:
+		case X_InternAtom:
+		case X_GetAtomName:
+		case X_GetProperty:
+		case X_ListProperties:
+		case X_GetSelectionOwner:
+		case X_GrabPointer:
+		case X_GrabKeyboard:
+		case X_QueryPointer:
+		case X_GetMotionEvents:
+		case X_TranslateCoords:
+		case X_GetInputFocus:
+		case X_QueryKeymap:
+		case X_QueryFont:
+		case X_QueryTextExtents:
+		case X_ListFonts:
+		case X_ListFontsWithInfo:
+		case X_GetFontPath:
+		case X_GetImage:
+		case X_ListInstalledColormaps:
+		case X_AllocColor:
+		case X_AllocNamedColor:
+		case X_AllocColorCells:
+		case X_AllocColorPlanes:
+		case X_QueryColors:
+		case X_LookupColor:
+		case X_QueryBestSize:
+		case X_QueryExtension:
+		case X_ListExtensions:
+		case X_GetKeyboardMapping:
+		case X_GetKeyboardControl:
+		case X_GetPointerControl:
+		case X_GetScreenSaver:
+		case X_ListHosts:
+		case X_SetPointerMapping:
+		case X_GetPointerMapping:
+		case X_SetModifierMapping:
+		case X_GetModifierMapping:
+			return true;
+		default:
+			return reqType >= 128; // Extension requests - assume they may have one
+	}
+}
+
+// ****************************************************************************
+
+// Window geometry mirror (MirrorGeometry), and event masks selected by the client.
+// Geometry is kept as the X server sees it (i.e. after any fixCoords rewriting of requests).
+// Windows managed by the window manager can only be tracked through the
+// ConfigureNotify events the client asked for.
+
+static bool trackingWindows()
+{
+	return config.mirrorGeometry || config.confineMouse;
+}
+
+struct WindowInfo
+{
+	struct WindowInfo *next;
+	Window id, parent, root;
+	INT16 x, y;
+	CARD16 width, height, borderWidth;
+	CARD8 depth;
+	CARD8 winGravity;
+	bool overrideRedirect;
+	bool managed; // has been a top-level window; the window manager decides its geometry
+	bool foreignChildren; // other clients have created or reparented windows into it
+	bool childrenKnown; // SubstructureNotifyMask selected since creation, so foreignChildren can be relied on
+	unsigned int children; // tracked windows with this one as their parent
+	bool tracked; // geometry is known to be up to date
+	CARD32 eventMask; // as selected by the client (see serverEventMask)
+};
+
+static struct WindowInfo **findWindowPtr(X11ConnData *data, Window id)
+{
+	struct WindowInfo **p;
+	for (p = &data->windows[id & 0xFF]; *p; p = &(*p)->next)
+		if ((*p)->id == id)
+			break;
+	return p;
+}
+
+static struct WindowInfo *findWindow(X11ConnData *data, Window id)
+{
+	return *findWindowPtr(data, id);
+}
+
+static int findRoot(X11ConnData *data, Window id)
+{
+	for (int i = 0; i < data->numRoots; i++)
+		if (data->roots[i] == id)
+			return i;
+	return -1;
+}
+
+static void removeWindow(X11ConnData *data, Window id, bool self)
+{
+	// Destroying a window destroys its subwindows as well
+	for (int i = 0; i < 256; i++)
+		for (struct WindowInfo *w = data->windows[i]; w; )
+			if (w->parent == id)
+			{
+				removeWindow(data, w->id, true);
+				w = data->windows[i]; // the removal may have freed any window in the list
+			}
+			else
+				w = w->next;
+
+	struct WindowInfo **p = findWindowPtr(data, id);
+	if (self && *p)
+	{
+		struct WindowInfo *w = *p;
+		*p = w->next;
+		struct WindowInfo *parent = findWindow(data, w->parent);
+		if (parent)
+			parent->children--;
+		free(w);
+	}
+}
+
+static void setParent(X11ConnData *data, struct WindowInfo *w, Window id)
+{
+	struct WindowInfo *parent = findWindow(data, w->parent);
+	if (parent)
+		parent->children--;
+	w->parent = id;
+	parent = findWindow(data, id);
+	if (parent)
+		parent->children++;
+}
+
+static void updateTracking(X11ConnData *data, struct WindowInfo *w)
+{
+	// The window manager gets to decide the geometry of top-level windows,
+	// also after it has reparented them into its frames.
+	if (!w->overrideRedirect && findRoot(data, w->parent) >= 0)
+		w->managed = true;
+
+	// Once we have missed a change, we cannot know the geometry any more.
+	if (w->managed && !(w->eventMask & StructureNotifyMask))
+		w->tracked = false;
+}
+
+static void windowResized(X11ConnData *data, struct WindowInfo *parent)
+{
+	// Subwindows with a window gravity other than the default may move.
+	for (int i = 0; i < 256; i++)
+		for (struct WindowInfo *w = data->windows[i]; w; w = w->next)
+			if (w->parent == parent->id && w->winGravity != NorthWestGravity)
+				w->tracked = false;
+}
+
+/// Returns a pointer to the value for the given bit in a request's value list, or NULL if not present.
+static CARD32 *findValue(CARD32 mask, void *values, CARD32 bit)
+{
+	if (!(mask & bit))
+		return NULL;
+	return (CARD32*)values + __builtin_popcount(mask & (bit - 1));
+}
+
+static void windowAttributes(struct WindowInfo *w, CARD32 mask, void *values)
+{
+	CARD32 *value;
+	if ((value = findValue(mask, values, CWWinGravity)))
+		w->winGravity = *value;
+	if ((value = findValue(mask, values, CWOverrideRedirect)))
+		w->overrideRedirect = *value;
+	if ((value = findValue(mask, values, CWEventMask)))
+		w->eventMask = *value;
+	if (!(w->eventMask & SubstructureNotifyMask))
+		w->childrenKnown = false;
+}
+
+static void windowCreated(X11ConnData *data, xCreateWindowReq *req)
+{
+	struct WindowInfo *w = calloc(1, sizeof(struct WindowInfo));
+	w->id = req->wid;
+	w->parent = req->parent;
+	w->x = req->x;
+	w->y = req->y;
+	w->width = req->width;
+	w->height = req->height;
+	w->borderWidth = req->borderWidth;
+	w->depth = req->depth;
+	w->winGravity = NorthWestGravity;
+	w->tracked = true;
+	w->childrenKnown = true;
+	windowAttributes(w, req->mask, (unsigned char*)req + sz_xCreateWindowReq);
+
+	int root = findRoot(data, req->parent);
+	struct WindowInfo *parent = findWindow(data, req->parent);
+	if (root >= 0)
+	{
+		w->root = req->parent;
+		if (!w->depth) // CopyFromParent
+			w->depth = data->rootDepths[root];
+	}
+	else
+	if (parent)
+	{
+		w->root = parent->root;
+		if (!w->depth)
+			w->depth = parent->depth;
+	}
+	else
+	if (data->numRoots == 1)
+		w->root = data->roots[0];
+	if (!w->depth || !w->root)
+		w->tracked = false;
+	updateTracking(data, w);
+
+	struct WindowInfo **p = findWindowPtr(data, w->id);
+	if (*p) // stale
+		removeWindow(data, w->id, true);
+	w->next = data->windows[w->id & 0xFF];
+	data->windows[w->id & 0xFF] = w;
+	parent = findWindow(data, w->parent); // the removal may have freed it
+	if (parent)
+		parent->children++;
+}
+
+static void windowConfigured(X11ConnData *data, Window id, INT16 x, INT16 y, CARD16 width, CARD16 height, CARD16 borderWidth)
+{
+	struct WindowInfo *w = findWindow(data, id);
+	if (!w)
+		return;
+	bool resized = w->width != width || w->height != height;
+	w->x = x;
+	w->y = y;
+	w->width = width;
+	w->height = height;
+	w->borderWidth = borderWidth;
+	if (resized)
+		windowResized(data, w);
+}
+
+static bool answerGetGeometry(X11ConnData *data, Window id)
+{
+	struct WindowInfo *w = findWindow(data, id);
+	// Also leave it to the server if there are events we have not seen yet.
+	if (!w || !w->tracked || readable(data->server))
+		return false;
+
+	xGetGeometryReply reply = {};
+	reply.type = X_Reply;
+	reply.depth = w->depth;
+	reply.root = w->root;
+	reply.x = w->x;
+	reply.y = w->y;
+	reply.width = w->width;
+	reply.height = w->height;
+	reply.borderWidth = w->borderWidth;
+	log_debug2("  XGetGeometry(%d,%d,%d,%d) (local)\n", reply.x, reply.y, reply.width, reply.height);
+	fixCoords(&reply.x, &reply.y, &reply.width, &reply.height);
+	log_debug2("  ->          (%d,%d,%d,%d)\n", reply.x, reply.y, reply.width, reply.height);
+	injectReply(data, &reply, sizeof(reply));
+	return true;
+}
+
+// Position of the window's origin (inside its border), relative to its root window.
+static bool windowOrigin(X11ConnData *data, Window id, int *x, int *y, Window *root)
+{
+	*x = *y = 0;
+	for (int depth = 0; depth < 256; depth++)
+	{
+		if (findRoot(data, id) >= 0)
+		{
+			*root = id;
+			return true;
+		}
+		struct WindowInfo *w = findWindow(data, id);
+		if (!w || !w->tracked)
+			return false; // e.g. reparented to a window manager frame
+		*x += w->x + w->borderWidth;
+		*y += w->y + w->borderWidth;
+		id = w->parent;
+	}
+	return false;
+}
+
+static bool answerTranslateCoords(X11ConnData *data, xTranslateCoordsReq *req)
+{
+	// We can't know which child of the destination window contains the point,
+	// unless it has no children. Those of other clients are only seen through
+	// SubstructureNotify events.
+	if (findRoot(data, req->dstWid) >= 0)
+		return false;
+	struct WindowInfo *dst = findWindow(data, req->dstWid);
+	if (!dst || !dst->childrenKnown || dst->foreignChildren || dst->children)
+		return false;
+
+	int srcX, srcY, dstX, dstY;
+	Window srcRoot, dstRoot;
+	if (!windowOrigin(data, req->srcWid, &srcX, &srcY, &srcRoot)
+	 || !windowOrigin(data, req->dstWid, &dstX, &dstY, &dstRoot)
+	 || srcRoot != dstRoot
+	 || readable(data->server))
+		return false;
+
+	xTranslateCoordsReply reply = {};
+	reply.type = X_Reply;
+	reply.sameScreen = true;
+	reply.child = None;
+	reply.dstX = req->srcX + srcX - dstX;
+	reply.dstY = req->srcY + srcY - dstY;
+	log_debug2("  XTranslateCoordinates(%d,%d) -> (%d,%d) (local)\n", req->srcX, req->srcY, reply.dstX, reply.dstY);
+	injectReply(data, &reply, sizeof(reply));
+	return true;
+}
+
+// ****************************************************************************
+
+// Pointer state tracking (TrackPointer).
+// The pointer state of the window the client queries with QueryPointer is
+// followed through the pointer events delivered to that window, so that
+// polling QueryPointer can be answered locally.
+// Events the client did not select itself are added and filtered out again.
+
+// Events we need to follow the pointer while it is in the window.
+#define POINTER_TRACK_MASK (PointerMotionMask | EnterWindowMask | LeaveWindowMask)
+// Events which we can't add without side effects (implicit grabs, keyboard focus),
+// so the client has to select them itself for the modifier and button state to be known.
+#define POINTER_CLIENT_MASK (KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask)
+
+static void trackPointerWindow(X11ConnData *data, Window window)
+{
+	// Events selected on the root window are only seen if no other window selects them
+	if (data->pointerWindow == window || findRoot(data, window) >= 0)
+		return;
+
+	if (data->pointerAddedMask)
+		selectEvents(data, data->pointerWindow, data->pointerClientMask);
+
+	log_debug("Tracking pointer in window 0x%lx\n", window);
+	data->pointerWindow = window;
+	data->pointerMaskKnown = data->pointerUsable = data->pointerValid = false;
+	data->pointerAddedMask = 0;
+
+	// Find out the client's event mask, and whether the window is a top-level window
+	// (so that selecting more events on it doesn't affect propagation to its other windows).
+	xResourceReq req;
+	req.reqType = X_GetWindowAttributes;
+	req.length = sizeof(req)/4;
+	req.id = window;
+	data->notes[injectRequest(data, &req, sizeof(req))] = Note_X_GetWindowAttributes_Pointer;
+	req.reqType = X_QueryTree;
+	data->notes[injectRequest(data, &req, sizeof(req))] = Note_X_QueryTree_Pointer;
+}
+
+static void pointerWindowParent(X11ConnData *data, Window parent)
+{
+	if (!data->pointerMaskKnown)
+		return;
+
+	CARD32 mask = data->pointerClientMask;
+	if ((mask & PointerMotionHintMask) || (mask & POINTER_CLIENT_MASK) != POINTER_CLIENT_MASK)
+	{
+		log_debug("Not tracking pointer in window 0x%lx (event mask 0x%"PRIxCARD32")\n", data->pointerWindow, mask);
+		return;
+	}
+
+	if ((mask & POINTER_TRACK_MASK) != POINTER_TRACK_MASK)
+	{
+		if ((parent & ~data->ridMask) == data->ridBase)
+		{
+			log_debug("Not tracking pointer in window 0x%lx (not a top-level window)\n", data->pointerWindow);
+			return;
+		}
+		data->pointerAddedMask = POINTER_TRACK_MASK & ~mask;
+		selectEvents(data, data->pointerWindow, mask | data->pointerAddedMask);
+	}
+	data->pointerUsable = true;
+}
+
+// Called when the client changes the event mask of a window.
+// Returns the mask to actually select.
+static CARD32 pointerEventMask(X11ConnData *data, Window window, CARD32 mask)
+{
+	if (window != data->pointerWindow)
+		return mask;
+
+	data->pointerClientMask = mask;
+	data->pointerMaskKnown = true;
+	if ((mask & PointerMotionHintMask) || (mask & POINTER_CLIENT_MASK) != POINTER_CLIENT_MASK)
+	{
+		data->pointerUsable = data->pointerValid = false;
+		data->pointerAddedMask = 0;
+	}
+	if (data->pointerUsable)
+		data->pointerAddedMask = POINTER_TRACK_MASK & ~mask;
+	return mask | data->pointerAddedMask;
+}
+
+static void pointerMoved(X11ConnData *data, Window root, Window child, INT16 rootX, INT16 rootY, INT16 winX, INT16 winY, CARD16 state)
+{
+	data->pointer.root = root;
+	data->pointer.child = child;
+	data->pointer.rootX = rootX;
+	data->pointer.rootY = rootY;
+	data->pointer.winX = winX;
+	data->pointer.winY = winY;
+	data->pointer.mask = state;
+	data->pointerValid = data->pointerUsable && !data->pointerGrabbed;
+}
+
+static void pointerGrab(X11ConnData *data, const xGrabPointerReq *req)
+{
+	// Unless we will keep seeing the pointer events for the window we track
+	data->pointerGrabbed = !(req->grabWindow == data->pointerWindow
+		&& (req->eventMask & (PointerMotionMask | ButtonPressMask | ButtonReleaseMask)) == (PointerMotionMask | ButtonPressMask | ButtonReleaseMask));
+	if (data->pointerGrabbed)
+		data->pointerValid = false;
+}
+
+// Updates the pointer state from an event.
+// Returns true if the event should be filtered out (the client did not select it).
+static bool trackPointerEvent(X11ConnData *data, const xEvent *event)
+{
+	CARD32 clientMask = data->pointerClientMask;
+	switch (event->u.u.type)
+	{
+		case MotionNotify:
+		case ButtonPress:
+		case ButtonRelease:
+		case KeyPress:
+		case KeyRelease:
+		{
+			if (event->u.keyButtonPointer.event != data->pointerWindow)
+			{
+				// The pointer is in another of the client's windows, or grabbed
+				data->pointerValid = false;
+				return false;
+			}
+			if (!event->u.keyButtonPointer.sameScreen)
+			{
+				data->pointerValid = false;
+				return false;
+			}
+
+			CARD16 state = event->u.keyButtonPointer.state;
+			switch (event->u.u.type)
+			{
+				case ButtonPress:
+					if (event->u.u.detail >= 1 && event->u.u.detail <= 5)
+						state |= Button1Mask << (event->u.u.detail - 1);
+					break;
+				case ButtonRelease:
+					if (event->u.u.detail >= 1 && event->u.u.detail <= 5)
+						state &= ~(Button1Mask << (event->u.u.detail - 1));
+					break;
+			}
+			pointerMoved(data,
+				event->u.keyButtonPointer.root, event->u.keyButtonPointer.child,
+				event->u.keyButtonPointer.rootX, event->u.keyButtonPointer.rootY,
+				event->u.keyButtonPointer.eventX, event->u.keyButtonPointer.eventY,
+				state);
+			if (event->u.u.type == KeyPress || event->u.u.type == KeyRelease)
+				data->pointerValid = false; // modifier state may have changed
+
+			if (event->u.u.type == MotionNotify
+			 && (data->pointerAddedMask & PointerMotionMask)
+			 && !(clientMask & ButtonMotionMask && state & (Button1Mask | Button2Mask | Button3Mask | Button4Mask | Button5Mask))
+			 && !(clientMask & state & (Button1MotionMask | Button2MotionMask | Button3MotionMask | Button4MotionMask | Button5MotionMask)))
+				return true;
+			return false;
+		}
+
+		case EnterNotify:
+			if (event->u.enterLeave.event != data->pointerWindow)
+				return false;
+			if (event->u.enterLeave.flags & ELFlagSameScreen)
+				pointerMoved(data,
+					event->u.enterLeave.root, event->u.enterLeave.child,
+					event->u.enterLeave.rootX, event->u.enterLeave.rootY,
+					event->u.enterLeave.eventX, event->u.enterLeave.eventY,
+					event->u.enterLeave.state);
+			return (data->pointerAddedMask & EnterWindowMask) != 0;
+
+		case LeaveNotify:
+			if (event->u.enterLeave.event != data->pointerWindow)
+				return false;
+			// Also when the pointer enters a child window which selected pointer events itself
+			data->pointerValid = false;
+			return (data->pointerAddedMask & LeaveWindowMask) != 0;
+
+		case DestroyNotify:
+			if (event->u.destroyNotify.window == data->pointerWindow)
+				data->pointerWindow = 0, data->pointerUsable = data->pointerValid = false, data->pointerAddedMask = 0;
+			return false;
+	}
+	return false;
+}
+
+static bool answerQueryPointer(X11ConnData *data, Window window)
+{
+	if (window != data->pointerWindow || !data->pointerValid || readable(data->server))
+		return false;
+
+	xQueryPointerReply reply = data->pointer;
+	reply.type = X_Reply;
+	reply.sameScreen = true;
+	log_debug2("  XQueryPointer(%d,%d) (local)\n", reply.winX, reply.winY);
+	injectReply(data, &reply, sizeof(reply));
+	return true;
+}
+
+// ****************************************************************************
+
+// Root window property cache (CacheRootProperties).
+// We select PropertyChangeMask on the root windows ourselves, so that we
+// learn of every change to the cached properties.
+
+static void selectRootProperties(X11ConnData *data)
+{
+	data->propertyCache = calloc(1, sizeof(struct ReplyCache));
+	// A new connection has not selected any events yet
+	for (int i = 0; i < data->numRoots; i++)
+		selectEvents(data, data->roots[i], PropertyChangeMask);
+}
+
+// Called when the client changes the event mask of a window.
+// Returns the mask to actually select.
+static CARD32 rootEventMask(X11ConnData *data, Window window, CARD32 mask)
+{
+	int root = findRoot(data, window);
+	if (root < 0)
+		return mask;
+	data->rootEventMasks[root] = mask;
+	return mask | PropertyChangeMask;
+}
+
+// ****************************************************************************
+
+// Startup prefetching (Prefetch).
+// Right after connection setup, we send the QueryExtension and InternAtom
+// requests most clients make on startup in one go, and answer the client's
+// requests from their replies, instead of waiting for a round trip each.
+// The replies go through the same notes as the client's own would.
+
+static const char *prefetchExtensions[] = {
+	"BIG-REQUESTS",
+	"RANDR",
+	"XINERAMA",
+	"XKEYBOARD",
+	"GLX",
+	"Present",
+	"XFIXES",
+	"RENDER",
+	"MIT-SHM",
+	"XInputExtension",
+};
+
+static const char *prefetchAtoms[] = {
+	"WM_PROTOCOLS",
+	"WM_DELETE_WINDOW",
+	"WM_STATE",
+	"UTF8_STRING",
+	"_MOTIF_WM_HINTS",
+	"_NET_SUPPORTED",
+	"_NET_ACTIVE_WINDOW",
+	"_NET_WORKAREA",
+	"_NET_CURRENT_DESKTOP",
+	"_NET_FRAME_EXTENTS",
+	"_NET_WM_NAME",
+	"_NET_WM_ICON_NAME",
+	"_NET_WM_ICON",
+	"_NET_WM_PID",
+	"_NET_WM_PING",
+	"_NET_WM_STATE",
+	"_NET_WM_STATE_FULLSCREEN",
+	"_NET_WM_STATE_ABOVE",
+	"_NET_WM_STATE_MAXIMIZED_VERT",
+	"_NET_WM_STATE_MAXIMIZED_HORZ",
+	"_NET_WM_WINDOW_TYPE",
+	"_NET_WM_WINDOW_TYPE_NORMAL",
+	"_NET_WM_BYPASS_COMPOSITOR",
+};
+
+struct Prefetched
+{
+	struct Prefetched *next;
+	CARD16 serial;
+	CARD8 reqType;
+	bool done, valid;
+	xReply reply;
+	size_t nameLength;
+	char name[];
+};
+
+static unsigned char queryExtensionNote(const char *name, size_t length)
+{
+	if (!strmemcmp("XFree86-VidModeExtension", name, length))
+		return Note_X_QueryExtension_XFree86_VidModeExtension;
+	if (!strmemcmp("RANDR", name, length))
+		return Note_X_QueryExtension_RANDR;
+	if (!strmemcmp("XINERAMA", name, length))
+		return Note_X_QueryExtension_Xinerama;
+	if (!strmemcmp("NV-GLX", name, length))
+		return Note_X_QueryExtension_NV_GLX;
+	if (!strmemcmp("XKEYBOARD", name, length))
+		return Note_X_QueryExtension_XKEYBOARD;
+	if (!strmemcmp("GLX", name, length))
+		return Note_X_QueryExtension_GLX;
+	return Note_X_QueryExtension_Other;
+}
+
+static unsigned char internAtomNote(const char *name, size_t length)
+{
+	if (!strmemcmp("_NET_ACTIVE_WINDOW", name, length))
+		return Note_X_InternAtom__NET_ACTIVE_WINDOW;
+	return Note_X_InternAtom_Other;
+}
+
+static void prefetchOne(X11ConnData *data, CARD8 reqType, const char *name)
+{
+	size_t nameLength = strlen(name);
+	// xQueryExtensionReq and xInternAtomReq have the same layout
+	unsigned char buf[sz_xInternAtomReq + 256] = {};
+	if (nameLength > sizeof(buf) - sz_xInternAtomReq)
+		return;
+
+	struct Prefetched *prefetched = calloc(1, sizeof(struct Prefetched) + nameLength);
+	prefetched->reqType = reqType;
+	prefetched->nameLength = nameLength;
+	memcpy(prefetched->name, name, nameLength);
+
+	xInternAtomReq *req = (xInternAtomReq*)buf;
+	req->reqType = reqType;
+	// Atoms are only looked up, not created; a missing atom is left to the client.
+	req->onlyIfExists = true;
+	req->nbytes = nameLength;
+	req->length = (sz_xInternAtomReq + pad(nameLength)) / 4;
+	memcpy(buf + sz_xInternAtomReq, name, nameLength);
+	prefetched->serial = injectRequest(data, buf, req->length * 4);
+	data->notes[prefetched->serial] = reqType == X_InternAtom
+		? internAtomNote(name, nameLength)
+		: queryExtensionNote(name, nameLength);
+
+	prefetched->next = data->prefetched;
+	data->prefetched = prefetched;
+	data->prefetchPending++;
+}
+
+static void prefetch(X11ConnData *data)
+{
+	if (config.prefetches)
+		for (struct PrefetchConfig *p = config.prefetches; p; p = p->next)
+			prefetchOne(data, p->reqType, p->name);
+	else
+	{
+		for (size_t i = 0; i < sizeof(prefetchExtensions) / sizeof(*prefetchExtensions); i++)
+			prefetchOne(data, X_QueryExtension, prefetchExtensions[i]);
+		for (size_t i = 0; i < sizeof(prefetchAtoms) / sizeof(*prefetchAtoms); i++)
+			prefetchOne(data, X_InternAtom, prefetchAtoms[i]);
+	}
+	log_debug("Prefetching %d replies\n", data->prefetchPending);
+}
+
+/// Called for every reply and error from the server.
+static void prefetchComplete(X11ConnData *data, const xReply *reply)
+{
+	for (struct Prefetched *p = data->prefetched; p; p = p->next)
+		if (!p->done && p->serial == reply->generic.sequenceNumber)
+		{
+			p->done = true;
+			p->reply = *reply;
+			// An atom which does not exist yet may be created by the client's request
+			p->valid = reply->generic.type == X_Reply
+				&& (p->reqType != X_InternAtom || reply->atom.atom != None);
+			data->prefetchPending--;
+			break;
+		}
+}
+
+static bool answerPrefetched(X11ConnData *data, CARD8 reqType, const char *name, size_t nameLength)
+{
+	for (struct Prefetched *p = data->prefetched; p; p = p->next)
+		if (p->reqType == reqType && p->nameLength == nameLength && !memcmp(p->name, name, nameLength))
+		{
+			if (!p->valid)
+				return false;
+			log_debug2(" Answering from prefetched reply\n");
+			xReply reply = p->reply;
+			injectReply(data, &reply, sizeof(reply));
+			return true;
+		}
+	return false;
+}
+
+// ****************************************************************************
+
+// Motion event compression (CompressMotion).
+// When the client is not keeping up with the events we send it, a
+// MotionNotify event which is immediately followed by another one for the
+// same window is dropped, as the client would only act on the latest position.
+
+static bool clientBacklogged(X11ConnData *data)
+{
+	if (queued(&data->toClient))
+		return true;
+	int unread;
+	return ioctl(data->client, SIOCOUTQ, &unread) == 0 && unread > 0;
+}
+
+static bool motionSuperseded(X11ConnData *data, const xEvent *event)
+{
+	if (event->u.u.detail != NotifyNormal) // hints are only sent once until the client queries the pointer
+		return false;
+	if (!clientBacklogged(data))
+		return false;
+
+	xEvent next;
+	if (recv(data->server, &next, sizeof(next), MSG_PEEK | MSG_DONTWAIT) != sizeof(next))
+		return false;
+	return next.u.u.type == MotionNotify
+		&& next.u.u.detail == NotifyNormal
+		&& next.u.keyButtonPointer.event == event->u.keyButtonPointer.event
+		&& next.u.keyButtonPointer.child == event->u.keyButtonPointer.child
+		&& next.u.keyButtonPointer.state == event->u.keyButtonPointer.state
+		&& next.u.keyButtonPointer.sameScreen == event->u.keyButtonPointer.sameScreen;
+}
+
+// ****************************************************************************
+
+// ConfigureNotify / Expose compression (CompressConfigure).
+// Resizing a window produces bursts of ConfigureNotify and Expose events.
+// If the server has already sent us a later ConfigureNotify for the same
+// window, or a later Expose which covers the same area, the current one is dropped.
+// Clients which wait for an Expose with a zero count will still get one, from the later series.
+
+/// Returns whether fn is true for any complete event already queued on the server socket.
+static bool anyQueuedEvent(X11ConnData *data, const xEvent *event, bool (*fn)(const xEvent *event, const xEvent *queued))
+{
+	unsigned char buf[1<<14];
+	ssize_t length = recv(data->server, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	for (ssize_t ofs = 0; ofs + sz_xEvent <= length; )
+	{
+		const xReply *reply = (const xReply*)(buf + ofs);
+		if (reply->generic.type == X_Reply || reply->generic.type == GenericEvent)
+			ofs += sz_xReply + reply->generic.length * 4;
+		else
+		{
+			if (reply->generic.type != X_Error && fn(event, &reply->event))
+				return true;
+			ofs += sz_xEvent;
+		}
+	}
+	return false;
+}
+
+static bool configureSuperseded(const xEvent *event, const xEvent *queued)
+{
+	return queued->u.u.type == event->u.u.type // also whether it is synthetic
+		&& queued->u.configureNotify.event == event->u.configureNotify.event
+		&& queued->u.configureNotify.window == event->u.configureNotify.window;
+}
+
+static bool exposeSuperseded(const xEvent *event, const xEvent *queued)
+{
+	return queued->u.u.type == Expose
+		&& queued->u.expose.window == event->u.expose.window
+		&& queued->u.expose.x <= event->u.expose.x
+		&& queued->u.expose.y <= event->u.expose.y
+		&& queued->u.expose.x + queued->u.expose.width >= event->u.expose.x + event->u.expose.width
+		&& queued->u.expose.y + queued->u.expose.height >= event->u.expose.y + event->u.expose.height;
+}
+
+// ****************************************************************************
+
+// ConfigureWindow coalescing (CoalesceConfigure).
+// A ConfigureWindow request immediately followed by another one for the same
+// window is not forwarded; instead, its values are merged into the next one.
+// ConfigureWindow has no reply, so only errors could tell the difference.
+
+static bool nextRequestConfigures(X11ConnData *data, Window window)
+{
+	unsigned char buf[sz_xConfigureWindowReq + 7 * 4];
+	ssize_t length = recv(data->client, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	if (length < sz_xConfigureWindowReq)
+		return false;
+	xConfigureWindowReq *req = (xConfigureWindowReq*)buf;
+	return req->reqType == X_ConfigureWindow
+		&& req->length != 0
+		&& length >= req->length * 4 // the whole request is here
+		&& req->window == window;
+}
+
+static void holdConfigure(X11ConnData *data, xConfigureWindowReq *req)
+{
+	data->heldConfigureWindow = req->window;
+	data->heldConfigureMask = req->mask & 0x7F;
+	for (int i = 0; i < 7; i++)
+	{
+		CARD32 *value = findValue(req->mask, (unsigned char*)req + sz_xConfigureWindowReq, 1 << i);
+		if (value)
+			data->heldConfigureValues[i] = *value;
+	}
+}
+
+/// Rewrites the ConfigureWindow request in data->buf to include the held values.
+static void mergeConfigure(X11ConnData *data, uint *requestLength)
+{
+	xConfigureWindowReq *req = (xConfigureWindowReq*)data->buf;
+	// The sibling only means something together with its stack mode, so
+	// a newer stack mode replaces both
+	if (req->mask & CWStackMode)
+		data->heldConfigureMask &= ~(CWSibling | CWStackMode);
+	CARD16 mask = req->mask | data->heldConfigureMask;
+	CARD32 values[7];
+	int n = 0;
+	for (int i = 0; i < 7; i++)
+	{
+		CARD32 *value = findValue(req->mask, data->buf + sz_xConfigureWindowReq, 1 << i);
+		if (value)
+			values[n++] = *value;
+		else
+		if (data->heldConfigureMask & (1 << i))
+			values[n++] = data->heldConfigureValues[i];
+	}
+	log_debug2(" Merging held ConfigureWindow (mask 0x%04X + 0x%04X)\n", data->heldConfigureMask, req->mask);
+	data->heldConfigureWindow = 0;
+
+	*requestLength = sz_xConfigureWindowReq + n * 4;
+	bufSize(&data->buf, &data->bufLen, *requestLength);
+	req = (xConfigureWindowReq*)data->buf;
+	req->mask = mask;
+	req->length = *requestLength / 4;
+	memcpy(data->buf + sz_xConfigureWindowReq, values, n * 4);
+}
+
+// ****************************************************************************
+
+// Event masks.
+// The masks the client selects on its windows are recorded (see WindowInfo),
+// and features which need to see more events than the client asked for add
+// them here; they filter out the extra events again in handleServerData.
+// Removing bits is only possible where a mask bit selects nothing but
+// events hax11 would drop: e.g. FilterFocus can't clear FocusChangeMask,
+// as it selects FocusIn events as well.
+
+/// Called when the client selects events on a window.
+/// Returns the mask to actually select on the server.
+static CARD32 serverEventMask(X11ConnData *data, Window window, CARD32 mask)
+{
+	CARD32 serverMask = mask;
+	if (config.trackPointer)
+		serverMask |= pointerEventMask(data, window, mask);
+	if (config.cacheRootProperties)
+		serverMask |= rootEventMask(data, window, mask);
+	return serverMask;
+}
+
+/// The event mask the client selected on a window, or ~0 if unknown.
+static CARD32 clientEventMask(X11ConnData *data, Window window)
+{
+	int root = findRoot(data, window);
+	if (root >= 0 && config.cacheRootProperties)
+		return data->rootEventMasks[root];
+	struct WindowInfo *w = findWindow(data, window);
+	if (w)
+		return w->eventMask;
+	return ~0;
+}
+
+// ****************************************************************************
+
+static void grabPointer(X11ConnData* data, Window window)
 {
 	xGrabPointerReq req;
 	req.reqType = X_GrabPointer;
 	req.ownerEvents = true; // ?
 	req.length = sizeof(req)/4;
 	req.grabWindow = window;
-	req.eventMask = ~0xFFFF8003;
+	// Pointer events outside the client's windows are reported to the grab window
+	// with this mask, so only ask for those the client would get there anyway.
+	req.eventMask = clientEventMask(data, window) & ~0xFFFF8003;
 	req.pointerMode = 1 /* Asynchronous */;
 	req.keyboardMode = 1 /* Asynchronous */;
 	req.confineTo = window;
@@ -941,7 +3067,15 @@ static void grabPointer(X11ConnData* data, Window window)
 	data->notes[serial] = Note_X_GrabPointer;
 }
 
-static void handleServerHandshake(void* buf, size_t length)
+static CARD32 hashBytes(CARD32 hash, const void* buf, size_t length)
+{
+	// FNV-1a
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ ((const unsigned char*)buf)[i]) * 16777619;
+	return hash;
+}
+
+static void handleServerHandshake(X11ConnData* data, void* buf, size_t length)
 {
 	size_t usedbytes = sz_xConnSetup;
 	if (length < usedbytes)
@@ -951,15 +3085,21 @@ static void handleServerHandshake(void* buf, size_t length)
 	}
 	xConnSetup* c = (xConnSetup *)buf;
 	buf += sz_xConnSetup;
-	log_debug2(" xConnSetup vendor='%.*s' numRoots=%d numFormats=%d\n",
-			   c->nbytesVendor, (char*) buf, c->numRoots, c->numFormats);
-
-	// fakeScreenResolution
-	if (config.fakeScreenW == 0
-	&& config.fakeScreenH == 0
-	&& config.fakeScreenDimW == 0
-	&& config.fakeScreenDimH == 0)
-		return;
+	data->ridBase = c->ridBase;
+	data->ridMask = c->ridMask;
+	log_debug2(" xConnSetup vendor='%.*s' release=%"PRIuCARD32" numRoots=%d numFormats=%d\n",
+			   c->nbytesVendor, (char*) buf, c->release, c->numRoots, c->numFormats);
+
+	// The vendor string and release identify the server build; the screens
+	// (as the server reported them, before any faking) its configuration.
+	data->setupHash = hashBytes(2166136261u, &c->release, sizeof(c->release));
+	if (length >= usedbytes + c->nbytesVendor)
+		data->setupHash = hashBytes(data->setupHash, buf, c->nbytesVendor);
+
+	bool fakeScreenResolution = config.fakeScreenW != 0
+		|| config.fakeScreenH != 0
+		|| config.fakeScreenDimW != 0
+		|| config.fakeScreenDimH != 0;
 	// vendor length is padded to 4 bytes
 	// https://github.com/mirror/libX11/blob/ff8706a5eae25b8bafce300527079f68a201d27f/src/OpenDis.c#L311-L336
 	usedbytes += pad(c->nbytesVendor) + sz_xPixmapFormat * c->numFormats;
@@ -983,18 +3123,31 @@ static void handleServerHandshake(void* buf, size_t length)
 
 		log_debug2(" xWindowRoot #%d (%dx%d %dmmx%dmm)\n",
 				   i, root->pixWidth, root->pixHeight, root->mmWidth, root->mmHeight);
-		if (config.fakeScreenW > 0)
-			root->pixWidth = config.fakeScreenW;
-		if (config.fakeScreenH > 0)
-			root->pixHeight = config.fakeScreenH;
-
-		if (config.fakeScreenDimW > 0)
-			root->mmWidth = config.fakeScreenDimW;
-		if (config.fakeScreenDimH > 0)
-			root->mmHeight = config.fakeScreenDimH;
-
-		log_debug2(" ->             (%dx%d %dmmx%dmm)\n",
-				   root->pixWidth, root->pixHeight, root->mmWidth, root->mmHeight);
+		data->setupHash = hashBytes(data->setupHash, &root->pixWidth, sizeof(root->pixWidth));
+		data->setupHash = hashBytes(data->setupHash, &root->pixHeight, sizeof(root->pixHeight));
+		data->setupHash = hashBytes(data->setupHash, &root->rootVisualID, sizeof(root->rootVisualID));
+		if (data->numRoots < (int)(sizeof(data->roots) / sizeof(*data->roots)))
+		{
+			data->roots[data->numRoots] = root->windowId;
+			data->rootDepths[data->numRoots] = root->rootDepth;
+			data->numRoots++;
+		}
+
+		if (fakeScreenResolution)
+		{
+			if (config.fakeScreenW > 0)
+				root->pixWidth = config.fakeScreenW;
+			if (config.fakeScreenH > 0)
+				root->pixHeight = config.fakeScreenH;
+
+			if (config.fakeScreenDimW > 0)
+				root->mmWidth = config.fakeScreenDimW;
+			if (config.fakeScreenDimH > 0)
+				root->mmHeight = config.fakeScreenDimH;
+
+			log_debug2(" ->             (%dx%d %dmmx%dmm)\n",
+					   root->pixWidth, root->pixHeight, root->mmWidth, root->mmHeight);
+		}
 		// now skip to the next root
 		// after each root there are nDepths of xDepth
 		for (int j = 0; j < root->nDepths; ++j) {
@@ -1014,6 +3167,7 @@ static void handleServerHandshake(void* buf, size_t length)
 				log_debug2("malformed handshake: Too short\n");
 				return;
 			}
+			data->setupHash = hashBytes(data->setupHash, depth, sz_xDepth + depth->nVisuals * sz_xVisualType);
 			buf += depth->nVisuals * sz_xVisualType;
 		}
 		// now we should hopefully be at the next root.
@@ -1026,12 +3180,142 @@ static void handleServerHandshake(void* buf, size_t length)
 	}
 }
 
+static bool handleServerData(X11ConnData* data);
+
+// Core requests handleClientData acts on with the current configuration.
+static __thread bool requestHandled[128];
+
+static void compileRequestActions()
+{
+	static const CARD8 always[] = {
+		X_CreateWindow, X_ConfigureWindow, X_GetGeometry, // fixCoords
+		X_ChangeProperty, // size hints
+		X_InternAtom, X_QueryExtension, // notes for learned atoms and opcodes
+		X_ListFontsWithInfo, // multiple replies
+	};
+	for (size_t i = 0; i < sizeof(always) / sizeof(*always); i++)
+		requestHandled[always[i]] = true;
+
+	requestHandled[X_ChangeWindowAttributes] = trackingWindows() || config.trackPointer || config.cacheRootProperties;
+	requestHandled[X_DestroyWindow] = requestHandled[X_DestroySubwindows] = trackingWindows() || config.trackPointer;
+	requestHandled[X_ReparentWindow] = trackingWindows();
+	requestHandled[X_TranslateCoords] = config.mirrorGeometry;
+	requestHandled[X_QueryPointer] = config.trackPointer;
+	requestHandled[X_GetProperty] = requestHandled[X_DeleteProperty] = requestHandled[X_RotateProperties] = config.cacheRootProperties;
+	requestHandled[X_GetWindowAttributes] = config.cacheRootProperties;
+	requestHandled[X_GrabPointer] = config.noMouseGrab || config.trackPointer;
+	requestHandled[X_UngrabPointer] = config.confineMouse || config.trackPointer;
+	requestHandled[X_GrabKeyboard] = config.noKeyboardGrab;
+	requestHandled[X_SendEvent] = config.noWMRaise; // _NET_ACTIVE_WINDOW messages
+	requestHandled[X_GetSelectionOwner] = requestHandled[X_SetSelectionOwner] = requestHandled[X_ConvertSelection] = config.noPrimarySelection;
+	requestHandled[X_GetKeyboardMapping] = requestHandled[X_GetModifierMapping] =
+		requestHandled[X_ChangeKeyboardMapping] = requestHandled[X_SetModifierMapping] = config.cacheKeymap;
+	requestHandled[X_OpenFont] = requestHandled[X_CloseFont] = requestHandled[X_QueryFont] = requestHandled[X_ListFonts] =
+		requestHandled[X_GetFontPath] = requestHandled[X_SetFontPath] = config.cacheFonts;
+}
+
+static bool requestNeedsHandling(X11ConnData* data, CARD8 reqType)
+{
+	if (reqType < 128)
+		return requestHandled[reqType];
+	return reqType == data->opcode_XFree86_VidModeExtension
+		|| reqType == data->opcode_RANDR
+		|| reqType == data->opcode_Xinerama
+		|| reqType == data->opcode_NV_GLX
+		|| reqType == data->opcode_XKEYBOARD
+		|| reqType == data->opcode_GLX;
+}
+
+static bool forwardRequest(X11ConnData* data, struct Connection *conn, CARD16 sequenceNumber, size_t requestLength)
+{
+	if (requestHasReply(data->buf[0]) && !data->duplex) // only used to answer locally, which duplex mode excludes
+	{
+		data->replyPending = true;
+		data->serialReplyPending = sequenceNumber;
+	}
+
+	return sendAll(conn, data->buf, requestLength);
+}
+
+#define REQUEST_SLICE (1<<16)
+
+/// Pass a large request which needs no handling through in slices of what
+/// has arrived so far (at most REQUEST_SLICE bytes), handling server data
+/// in between instead of letting input events wait behind the request.
+/// data->buf holds the first ofs bytes of the request.
+static bool streamRequest(X11ConnData* data, struct Connection *conn, CARD16 sequenceNumber, size_t ofs, size_t requestLength)
+{
+	if (!forwardRequest(data, conn, sequenceNumber, ofs)) return false;
+
+	bufSize(&data->slice, &data->sliceLen, REQUEST_SLICE);
+	data->streaming = true;
+	size_t remaining = requestLength - ofs;
+	bool ok = true;
+	while (ok && remaining)
+	{
+		struct pollfd fds[2] = {
+			{
+				.fd = data->client,
+				.events = (queueFull(&data->toServer) ? 0 : POLLRDNORM) | (queued(&data->toClient) ? POLLOUT : 0),
+			},
+			{
+				.fd = data->server,
+				.events = (queueFull(&data->toClient) ? 0 : POLLRDNORM) | (queued(&data->toServer) ? POLLOUT : 0),
+			},
+		};
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			log_error("poll() failed");
+			ok = false;
+			break;
+		}
+		if ((fds[0].revents | fds[1].revents) & (POLLERR|POLLHUP|POLLNVAL))
+		{
+			log_debug("Error on socket while passing a request through\n");
+			ok = false;
+			break;
+		}
+		if (fds[0].revents & POLLOUT)
+			ok = ok && flushQueue(&data->toClient);
+		if (fds[1].revents & POLLOUT)
+			ok = ok && flushQueue(&data->toServer);
+
+		if (fds[1].revents & POLLRDNORM)
+		{
+			// Server first
+			if (config.debug)
+				data->serverReadyAt = monotonicNs();
+			ok = ok && handleServerData(data);
+			continue;
+		}
+		if (config.debug)
+			data->serverReadyAt = monotonicNs(); // server is idle
+
+		if (fds[0].revents & POLLRDNORM)
+		{
+			size_t size = remaining < REQUEST_SLICE ? remaining : REQUEST_SLICE;
+			int available;
+			if (ioctl(data->client, FIONREAD, &available) == 0 && available > 0 && (size_t)available < size)
+				size = available;
+			ok = ok && recvAll(conn, data->slice, size) && sendAll(conn, data->slice, size);
+			remaining -= size;
+		}
+	}
+	data->streaming = false;
+
+	// Now the requests injected meanwhile can follow
+	if (ok && queued(&data->heldRequests))
+		ok = sendAll(conn, data->heldRequests.buf + data->heldRequests.start, queued(&data->heldRequests));
+	data->heldRequests.start = data->heldRequests.end = 0;
+	return ok;
+}
+
 static bool handleClientData(X11ConnData* data)
 {
 	struct Connection conn = {};
-	conn.recvfd = data->client;
-	conn.sendfd = data->server;
-	conn.dir = '<';
+	relayConnection(data, &conn, true, '<');
 
 	if (config.dumb)
 	{
@@ -1061,6 +3345,28 @@ static bool handleClientData(X11ConnData* data)
 		return true;
 	}
 
+	if (config.cacheFonts && !data->fontPathChecked)
+	{
+		// Font requests can only be answered from the cache once we know whether
+		// the font path changed. The font path was requested on connection setup,
+		// so its reply should be here by now.
+		CARD8 reqType;
+		if (recv(conn.recvfd, &reqType, 1, MSG_PEEK) == 1
+		 && (reqType == X_QueryFont || reqType == X_ListFonts || reqType == X_ListFontsWithInfo))
+			while (!data->fontPathChecked)
+				if (!handleServerData(data)) return false;
+	}
+
+	if (data->prefetchPending)
+	{
+		// Wait for the prefetched replies, instead of asking the server again.
+		CARD8 reqType;
+		if (recv(conn.recvfd, &reqType, 1, MSG_PEEK) == 1
+		 && (reqType == X_QueryExtension || reqType == X_InternAtom))
+			while (data->prefetchPending)
+				if (!handleServerData(data)) return false;
+	}
+
 	size_t ofs = 0;
 	if (!recvAll(&conn, data->buf+ofs, sz_xReq)) return false;
 	ofs += sz_xReq;
@@ -1074,15 +3380,31 @@ static bool handleClientData(X11ConnData* data)
 		ofs += 4;
 	}
 	CARD16 sequenceNumber = ++data->serial;
+	data->clientSerial++;
 	logXReq(data, "Request", req, requestLength, sequenceNumber);
 
+	data->notes[sequenceNumber] = Note_None;
+	data->skip[sequenceNumber] = false;
+
+	if (config.debug < 2 && !data->duplex && requestLength - ofs > REQUEST_SLICE && !requestNeedsHandling(data, req->reqType))
+		return streamRequest(data, &conn, sequenceNumber, ofs, requestLength);
+
 	bufSize(&data->buf, &data->bufLen, requestLength);
 	req = (xReq*)data->buf; // in case bufSize moved buf
 
 	if (!recvAll(&conn, data->buf+ofs, requestLength - ofs)) return false;
 
-	data->notes[sequenceNumber] = Note_None;
-	data->skip[sequenceNumber] = false;
+	if (config.debug < 2 && !requestNeedsHandling(data, req->reqType))
+		return forwardRequest(data, &conn, sequenceNumber, requestLength);
+
+	if (req->reqType < 128 && requestLength < requestSizes[req->reqType])
+	{
+		// Too short to hold its fixed fields - don't look inside, and let the
+		// server answer it with BadLength.
+		log_debug("[%d] Request %d (%s) is too short (%u < %d bytes), forwarding as-is\n",
+			data->index, req->reqType, requestNames[req->reqType], requestLength, requestSizes[req->reqType]);
+		return forwardRequest(data, &conn, sequenceNumber, requestLength);
+	}
 
 	switch (req->reqType)
 	{
@@ -1093,11 +3415,121 @@ static bool handleClientData(X11ConnData* data)
 			log_debug2(" XCreateWindow(%dx%d @ %dx%d)\n", req->width, req->height, req->x, req->y);
 			fixCoords(&req->x, &req->y, &req->width, &req->height);
 			log_debug2(" ->           (%dx%d @ %dx%d)\n", req->width, req->height, req->x, req->y);
+			if (trackingWindows())
+				windowCreated(data, req);
+			CARD32 *eventMask = findValue(req->mask, data->buf + sz_xCreateWindowReq, CWEventMask);
+			if (eventMask)
+				*eventMask = serverEventMask(data, req->wid, *eventMask);
+			break;
+		}
+
+		case X_ChangeWindowAttributes:
+		{
+			xChangeWindowAttributesReq* req = (xChangeWindowAttributesReq*)data->buf;
+			if (trackingWindows())
+			{
+				struct WindowInfo *w = findWindow(data, req->window);
+				if (w)
+				{
+					windowAttributes(w, req->valueMask, data->buf + sz_xChangeWindowAttributesReq);
+					updateTracking(data, w);
+				}
+			}
+			CARD32 *eventMask = findValue(req->valueMask, data->buf + sz_xChangeWindowAttributesReq, CWEventMask);
+			if (eventMask)
+				*eventMask = serverEventMask(data, req->window, *eventMask);
 			break;
 		}
 
+		// Root window properties, polled e.g. for _NET_ACTIVE_WINDOW or _NET_WORKAREA
+		case X_GetProperty:
+			if (config.cacheRootProperties)
+			{
+				xGetPropertyReq* req = (xGetPropertyReq*)data->buf;
+				if (findRoot(data, req->window) < 0)
+					break;
+				if (req->delete)
+					cacheInvalidate(data->propertyCache, req->window, req->property);
+				else
+				// If there are events we have not seen yet, one of them may be a PropertyNotify.
+				if (!readable(data->server)
+				 && cacheAnswer(data, data->propertyCache, req->window, req->property, data->buf, requestLength, sequenceNumber))
+					return true;
+			}
+			break;
+
+		case X_DeleteProperty:
+			if (config.cacheRootProperties)
+			{
+				xDeletePropertyReq* req = (xDeletePropertyReq*)data->buf;
+				if (findRoot(data, req->window) >= 0)
+					cacheInvalidate(data->propertyCache, req->window, req->property);
+			}
+			break;
+
+		case X_RotateProperties:
+			if (config.cacheRootProperties)
+			{
+				xRotatePropertiesReq* req = (xRotatePropertiesReq*)data->buf;
+				if (findRoot(data, req->window) >= 0)
+					cacheInvalidate(data->propertyCache, req->window, 0);
+			}
+			break;
+
+		case X_QueryPointer:
+			if (config.trackPointer)
+			{
+				Window window = ((xResourceReq*)data->buf)->id;
+				if (answerQueryPointer(data, window))
+					return true;
+				data->pointerQueries[sequenceNumber % 64].serial = sequenceNumber;
+				data->pointerQueries[sequenceNumber % 64].window = window;
+				data->notes[sequenceNumber] = Note_X_QueryPointer;
+			}
+			break;
+
+		case X_DestroyWindow:
+		case X_DestroySubwindows:
+			if (trackingWindows())
+				removeWindow(data, ((xResourceReq*)data->buf)->id, req->reqType == X_DestroyWindow);
+			if (config.trackPointer && req->reqType == X_DestroyWindow && ((xResourceReq*)data->buf)->id == data->pointerWindow)
+				data->pointerWindow = 0, data->pointerUsable = data->pointerValid = false, data->pointerAddedMask = 0;
+			break;
+
+		case X_ReparentWindow:
+			if (trackingWindows())
+			{
+				xReparentWindowReq* req = (xReparentWindowReq*)data->buf;
+				struct WindowInfo *w = findWindow(data, req->window);
+				if (w)
+				{
+					setParent(data, w, req->parent);
+					w->x = req->x;
+					w->y = req->y;
+					updateTracking(data, w);
+				}
+			}
+			break;
+
 		case X_ConfigureWindow:
 		{
+			if (config.coalesceConfigure && req->length)
+			{
+				xConfigureWindowReq* req = (xConfigureWindowReq*)data->buf;
+				if (data->heldConfigureWindow == req->window)
+				{
+					mergeConfigure(data, &requestLength);
+					req = (xConfigureWindowReq*)data->buf; // in case bufSize moved buf
+				}
+				if (nextRequestConfigures(data, req->window))
+				{
+					log_debug2(" Holding ConfigureWindow to merge it with the next one\n");
+					holdConfigure(data, req);
+					dropRequest(data);
+					return true;
+				}
+			}
+
 			xConfigureWindowReq* req = (xConfigureWindowReq*)data->buf;
 
 			INT16 dummyX = 0, dummyY = 0;
@@ -1161,6 +3593,19 @@ static bool handleClientData(X11ConnData* data)
 			if ((req->mask & (CWWidth | CWHeight)) == (CWWidth | CWHeight) && *w == 0 && *h == 0)
 				__builtin_trap();
 
+			if (trackingWindows())
+			{
+				// Requests for managed windows are redirected to the window manager;
+				// we will see the outcome in ConfigureNotify.
+				struct WindowInfo *win = findWindow(data, req->window);
+				if (win && !win->managed)
+					windowConfigured(data, req->window,
+						req->mask & CWX           ? *x      : win->x,
+						req->mask & CWY           ? *y      : win->y,
+						req->mask & CWWidth       ? *w      : win->width,
+						req->mask & CWHeight      ? *h      : win->height,
+						req->mask & CWBorderWidth ? *border : win->borderWidth);
+			}
 			break;
 		}
 
@@ -1168,19 +3613,38 @@ static bool handleClientData(X11ConnData* data)
 		// (which can encompass multiple physical monitors).
 		case X_GetGeometry:
 		{
+			if (config.mirrorGeometry && answerGetGeometry(data, ((xResourceReq*)data->buf)->id))
+				return true;
 			data->notes[sequenceNumber] = Note_X_GetGeometry;
 			break;
 		}
 
+		case X_GetWindowAttributes:
+			if (config.cacheRootProperties)
+			{
+				int root = findRoot(data, ((xResourceReq*)data->buf)->id);
+				if (root >= 0)
+				{
+					data->notes[sequenceNumber] = Note_X_GetWindowAttributes_Root;
+					data->rootQueries[sequenceNumber % 64].serial = sequenceNumber;
+					data->rootQueries[sequenceNumber % 64].root = root;
+				}
+			}
+			break;
+
+		case X_TranslateCoords:
+			if (config.mirrorGeometry && answerTranslateCoords(data, (xTranslateCoordsReq*)data->buf))
+				return true;
+			break;
+
 		case X_InternAtom:
 		{
 			xInternAtomReq* req = (xInternAtomReq*)data->buf;
 			const char* name = (const char*)(data->buf + sz_xInternAtomReq);
 			log_debug2(" XInternAtom: %.*s\n", req->nbytes, name);
-			if (!strmemcmp("_NET_ACTIVE_WINDOW", name, req->nbytes))
-				data->notes[sequenceNumber] = Note_X_InternAtom__NET_ACTIVE_WINDOW;
-			else
-				data->notes[sequenceNumber] = Note_X_InternAtom_Other;
+			if (config.prefetch && answerPrefetched(data, X_InternAtom, name, req->nbytes))
+				return true;
+			data->notes[sequenceNumber] = internAtomNote(name, req->nbytes);
 			break;
 		}
 
@@ -1209,6 +3673,8 @@ static bool handleClientData(X11ConnData* data)
 				}
 				debugPropSizeHints(hints);
 			}
+			if (config.cacheRootProperties && findRoot(data, req->window) >= 0)
+				cacheInvalidate(data->propertyCache, req->window, req->property);
 			break;
 		}
 
@@ -1219,6 +3685,9 @@ static bool handleClientData(X11ConnData* data)
 				log_debug2(" X_UngrabPointer: Stubbing client request\n");
 				req->reqType = X_NoOperation;
 			}
+			else
+			if (config.trackPointer)
+				data->pointerGrabbed = false;
 			break;
 		}
 
@@ -1228,19 +3697,9 @@ static bool handleClientData(X11ConnData* data)
 			const char* name = (const char*)(data->buf + sz_xQueryExtensionReq);
 			log_debug2(" XQueryExtension(%.*s)\n", req->nbytes, name);
 
-			if (!strmemcmp("XFree86-VidModeExtension", name, req->nbytes))
-				data->notes[sequenceNumber] = Note_X_QueryExtension_XFree86_VidModeExtension;
-			else
-			if (!strmemcmp("RANDR", name, req->nbytes))
-				data->notes[sequenceNumber] = Note_X_QueryExtension_RANDR;
-			else
-			if (!strmemcmp("XINERAMA", name, req->nbytes))
-				data->notes[sequenceNumber] = Note_X_QueryExtension_Xinerama;
-			else
-			if (!strmemcmp("NV-GLX", name, req->nbytes))
-				data->notes[sequenceNumber] = Note_X_QueryExtension_NV_GLX;
-			else
-				data->notes[sequenceNumber] = Note_X_QueryExtension_Other;
+			if (config.prefetch && answerPrefetched(data, X_QueryExtension, name, req->nbytes))
+				return true;
+			data->notes[sequenceNumber] = queryExtensionNote(name, req->nbytes);
 			break;
 		}
 
@@ -1252,6 +3711,9 @@ static bool handleClientData(X11ConnData* data)
 				xGrabPointerReq* req = (xGrabPointerReq*)data->buf;
 				req->time = -1;
 			}
+			else
+			if (config.trackPointer)
+				pointerGrab(data, (xGrabPointerReq*)data->buf);
 			break;
 
 		case X_GrabKeyboard:
@@ -1336,6 +3798,67 @@ static bool handleClientData(X11ConnData* data)
 			}
 			break;
 		}
+		// Keyboard mapping, needed by every client on startup
+		case X_GetKeyboardMapping:
+		case X_GetModifierMapping:
+			if (config.cacheKeymap && cacheAnswer(data, &keymapCache, data->display, 0, data->buf, requestLength, sequenceNumber))
+				return true;
+			break;
+
+		case X_ChangeKeyboardMapping:
+		case X_SetModifierMapping:
+			if (config.cacheKeymap)
+				cacheInvalidate(&keymapCache, 0, 0);
+			break;
+
+		// Core fonts, enumerated on startup by older toolkits
+		case X_OpenFont:
+			if (config.cacheFonts)
+			{
+				xOpenFontReq* req = (xOpenFontReq*)data->buf;
+				rememberFont(data, req->fid, sequenceNumber, (const char*)(data->buf + sz_xOpenFontReq), req->nbytes);
+			}
+			break;
+
+		case X_CloseFont:
+			if (config.cacheFonts)
+				forgetFont(data, ((xResourceReq*)data->buf)->id);
+			break;
+
+		case X_QueryFont:
+			if (config.cacheFonts && data->fontPathChecked)
+			{
+				struct FontName *font = *findFont(data, ((xResourceReq*)data->buf)->id);
+				if (font && cacheAnswer(data, &fontCache, data->setupHash, 0, font->key, font->keyLength, sequenceNumber))
+					return true;
+			}
+			break;
+
+		case X_ListFonts:
+		case X_ListFontsWithInfo:
+			if (req->reqType == X_ListFontsWithInfo)
+				data->notes[sequenceNumber] = Note_X_ListFontsWithInfo;
+			if (config.cacheFonts && data->fontPathChecked
+			 && cacheAnswer(data, &fontCache, data->setupHash, 0, data->buf, requestLength, sequenceNumber))
+				return true;
+			break;
+
+		case X_GetFontPath:
+			data->notes[sequenceNumber] = Note_X_GetFontPath;
+			break;
+
+		case X_SetFontPath:
+			if (config.cacheFonts)
+			{
+				// Fonts may have changed even if the path is the same
+				// (e.g. "xset fp rehash").
+				cacheInvalidate(&fontCache, data->setupHash, 0);
+				if (!sendAll(&conn, data->buf, requestLength)) return false;
+				requestFontPath(data);
+				return true;
+			}
+			break;
+
 		case 0:
 			break;
 
@@ -1413,6 +3936,47 @@ static bool handleClientData(X11ConnData* data)
 #endif
 				data->notes[sequenceNumber] = Note_NV_GLX;
 			}
+			else
+			if (req->reqType == data->opcode_XKEYBOARD)
+			{
+				log_debug2(" XKEYBOARD - %d\n", req->data);
+				if (config.cacheKeymap)
+					switch (req->data)
+					{
+						case X_kbGetMap:
+						case X_kbGetNames:
+							if (cacheAnswer(data, &keymapCache, data->display, 0, data->buf, requestLength, sequenceNumber))
+								return true;
+							break;
+
+						case X_kbSetControls:
+						case X_kbSetMap:
+						case X_kbSetCompatMap:
+						case X_kbSetIndicatorMap:
+						case X_kbSetNamedIndicator:
+						case X_kbSetNames:
+						case X_kbSetGeometry:
+						case X_kbGetKbdByName: // may load a new keymap
+						case X_kbSetDeviceInfo:
+							cacheInvalidate(&keymapCache, 0, 0);
+							break;
+					}
+			}
+			else
+			if (req->reqType == data->opcode_GLX)
+			{
+				log_debug2(" GLX - %d\n", req->data);
+				if (config.cacheGLX)
+					switch (req->data)
+					{
+						case X_GLXQueryServerString:
+						case X_GLXGetVisualConfigs:
+						case X_GLXGetFBConfigs:
+							if (cacheAnswer(data, &glxCache, data->setupHash, 0, data->buf, requestLength, sequenceNumber))
+								return true;
+							break;
+					}
+			}
 			break;
 		}
 	}
@@ -1420,17 +3984,118 @@ static bool handleClientData(X11ConnData* data)
 	if (config.debug >= 2 && config.actualX && config.actualY && memmem(data->buf, requestLength, &config.actualX, 2) && memmem(data->buf, requestLength, &config.actualY, 2))
 		log_debug2("   Found actualW/H in input! ----------------------------------------------------------------------------------------------\n");
 
-	if (!sendAll(&conn, data->buf, requestLength)) return false;
+	return forwardRequest(data, &conn, sequenceNumber, requestLength);
+}
+
+// Catch up with the server's serial numbering up to this message's.
+static void serialAdvance(X11ConnData* data, const xReply *reply)
+{
+	while (data->serialLast != reply->generic.sequenceNumber)
+	{
+		data->skip[data->serialLast] = false;
+		data->serialLast++;
+		if (data->skip[data->serialLast])
+		{
+			data->serialDelta++;
+			log_debug2("  Incrementing serialDelta for injected reply (now at %d)\n", data->serialDelta);
+		}
+		if (data->answered[data->serialLast])
+		{
+			data->serialDelta -= data->answered[data->serialLast];
+			data->answered[data->serialLast] = 0;
+			log_debug2("  Decrementing serialDelta for locally answered requests (now at %d)\n", data->serialDelta);
+		}
+	}
+
+	if (data->replyPending
+	 && (reply->generic.type < 2 || reply->generic.sequenceNumber != data->serialReplyPending)
+	 && (CARD16)(reply->generic.sequenceNumber - data->serialReplyPending) < 0x8000
+	 && !(reply->generic.type == X_Reply
+	   && data->notes[reply->generic.sequenceNumber] == Note_X_ListFontsWithInfo
+	   && reply->generic.data1 != 0)) // more replies will follow
+		data->replyPending = false;
+}
+
+// ****************************************************************************
+
+// Event runs.
+// Most of the server's traffic is events which hax11 does not need to look
+// at with the active configuration. Once we get one of those, we also take
+// all directly following such events already queued on the socket, and
+// forward them together with only their serials translated.
+
+// Event types handleServerData acts on with the current configuration
+// (other than extension events, whose codes are only known per connection).
+static __thread bool eventHandled[256];
 
+static void compileEventActions()
+{
+	eventHandled[FocusIn] = config.confineMouse;
+	eventHandled[FocusOut] = config.confineMouse || config.filterFocus;
+	eventHandled[KeyPress] = eventHandled[KeyRelease] =
+		eventHandled[ButtonPress] = eventHandled[ButtonRelease] = config.maps || config.trackPointer;
+	eventHandled[MotionNotify] = config.trackPointer || config.compressMotion;
+	eventHandled[EnterNotify] = eventHandled[LeaveNotify] = config.trackPointer;
+	eventHandled[ConfigureNotify] = eventHandled[ConfigureNotify | 0x80] = trackingWindows() || config.compressConfigure;
+	eventHandled[Expose] = config.compressConfigure;
+	eventHandled[ReparentNotify] = eventHandled[GravityNotify] = eventHandled[CreateNotify] = trackingWindows();
+	eventHandled[DestroyNotify] = trackingWindows() || config.trackPointer;
+	eventHandled[PropertyNotify] = eventHandled[PropertyNotify | 0x80] = config.cacheRootProperties;
+	eventHandled[MappingNotify] = config.cacheKeymap;
+}
+
+static bool eventNeedsHandling(X11ConnData* data, CARD8 type)
+{
+	return type == X_Error
+		|| type == X_Reply
+		|| type == GenericEvent // variable size
+		|| type == KeymapNotify // has no serial
+		|| eventHandled[type]
+		|| (data->opcode_XKEYBOARD && (type & 0x7f) == data->event_XKEYBOARD);
+}
+
+/// Account for events having been passed on to the client.
+static void eventsForwarded(X11ConnData* data, size_t count)
+{
+	if (!config.debug || !data->serverReadyAt)
+		return;
+	uint64_t latency = monotonicNs() - data->serverReadyAt;
+	data->latencyEvents += count;
+	data->latencyTotal += latency * count;
+	if (latency > data->latencyMax)
+		data->latencyMax = latency;
+}
+
+/// Forward the event in data->buf, and the run of events following it
+/// which need no handling. conn is the server-to-client connection.
+static bool forwardEvents(X11ConnData* data, struct Connection *conn)
+{
+	enum { maxEvents = 256 };
+	bufSize(&data->serverBuf, &data->serverBufLen, maxEvents * sz_xEvent);
+	ssize_t queued = recv(data->server, data->serverBuf + sz_xEvent, (maxEvents - 1) * sz_xEvent, MSG_PEEK | MSG_DONTWAIT);
+	size_t available = 1 + (queued > 0 ? queued / sz_xEvent : 0); // complete events in buf
+	size_t count = 1;
+	while (count < available && !eventNeedsHandling(data, data->serverBuf[count * sz_xEvent]))
+		count++;
+	if (count > 1 && !recvAll(conn, data->serverBuf + sz_xEvent, (count - 1) * sz_xEvent)) return false;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		xReply* reply = (xReply*)(data->serverBuf + i * sz_xEvent);
+		serialAdvance(data, reply);
+		reply->generic.sequenceNumber -= data->serialDelta;
+	}
+	if (!sendAll(conn, data->serverBuf, count * sz_xEvent)) return false;
+	eventsForwarded(data, count);
 	return true;
 }
 
+// ****************************************************************************
+
 static bool handleServerData(X11ConnData* data)
 {
 	struct Connection conn = {};
-	conn.recvfd = data->server;
-	conn.sendfd = data->client;
-	conn.dir = '>';
+	relayConnection(data, &conn, false, '>');
 
 	if (config.dumb)
 	{
@@ -1449,44 +4114,109 @@ static bool handleServerData(X11ConnData* data)
 		log_debug("Server connection setup reply: %d\n", header.success);
 
 		size_t dataLength = header.length * 4;
-		bufSize(&data->buf, &data->bufLen, dataLength);
-		if (!recvAll(&conn, data->buf, dataLength)) return false;
-		handleServerHandshake(data->buf, dataLength);
-		if (!sendAll(&conn, data->buf, dataLength)) return false;
+		bufSize(&data->serverBuf, &data->serverBufLen, dataLength);
+		if (!recvAll(&conn, data->serverBuf, dataLength)) return false;
+		handleServerHandshake(data, data->serverBuf, dataLength);
+		if (!sendAll(&conn, data->serverBuf, dataLength)) return false;
 
 		data->serverInitialized = true;
+
+		if (header.success && config.cacheFonts)
+			requestFontPath(data);
+		if (header.success && config.cacheRootProperties)
+			selectRootProperties(data);
+		if (header.success && config.prefetch)
+			prefetch(data);
+		return true;
+	}
+
+	if (!recvAll(&conn, data->serverBuf, sz_xReply)) return false;
+	size_t ofs = sz_xReply;
+	xReply* reply = (xReply*)data->serverBuf;
+
+	if (reply->generic.type == X_Reply || reply->generic.type == GenericEvent)
+	{
+		size_t dataLength = reply->generic.length * 4;
+		bufSize(&data->serverBuf, &data->serverBufLen, ofs + dataLength);
+		reply = (xReply*)data->serverBuf; // in case bufSize moved buf
+		if (!recvAll(&conn, data->serverBuf+ofs, dataLength)) return false;
+		ofs += dataLength;
+	}
+	logXReply(data, "Response", reply, ofs);
+
+	if (config.debug < 2 && !eventNeedsHandling(data, reply->generic.type))
+		return forwardEvents(data, &conn);
+
+	if (reply->generic.type == X_Reply || reply->generic.type == X_Error)
+	{
+		cacheComplete(data, reply, ofs);
+		if (data->prefetchPending)
+			prefetchComplete(data, reply);
+	}
+
+	bool serialIsValid = true;
+
+	if (config.trackPointer && data->pointerWindow && reply->generic.type > X_Reply && trackPointerEvent(data, &reply->event))
+	{
+		log_debug2("Filtering out pointer tracking event\n");
 		return true;
 	}
 
-	if (!recvAll(&conn, data->buf, sz_xReply)) return false;
-	size_t ofs = sz_xReply;
-	xReply* reply = (xReply*)data->buf;
-
-	if (reply->generic.type == X_Reply || reply->generic.type == GenericEvent)
+	if (config.compressMotion && reply->generic.type == MotionNotify)
+	{
+		data->motionEvents++;
+		if (motionSuperseded(data, &reply->event))
+		{
+			data->motionMerged++;
+			log_debug2("Dropping superseded MotionNotify event\n");
+			return true;
+		}
+	}
+
+	if (config.compressConfigure && (reply->generic.type & 0x7f) == ConfigureNotify)
+	{
+		data->configureEvents++;
+		if (anyQueuedEvent(data, &reply->event, configureSuperseded))
+		{
+			data->configureMerged++;
+			log_debug2("Dropping superseded ConfigureNotify event\n");
+			return true;
+		}
+	}
+
+	if (config.compressConfigure && reply->generic.type == Expose)
 	{
-		size_t dataLength = reply->generic.length * 4;
-		bufSize(&data->buf, &data->bufLen, ofs + dataLength);
-		reply = (xReply*)data->buf; // in case bufSize moved buf
-		if (!recvAll(&conn, data->buf+ofs, dataLength)) return false;
-		ofs += dataLength;
+		data->exposeEvents++;
+		if (anyQueuedEvent(data, &reply->event, exposeSuperseded))
+		{
+			data->exposeMerged++;
+			log_debug2("Dropping superseded Expose event\n");
+			return true;
+		}
 	}
-	logXReply(data, "Response", reply, ofs);
-
-	bool serialIsValid = true;
 
 	switch (reply->generic.type)
 	{
 		case X_Error:
 		{
-			xError* err = (xError*)data->buf;
+			xError* err = (xError*)data->serverBuf;
 			log_debug2(" [%d] Error - code=%d resourceID=0x%"PRIxCARD32" minorCode=%d majorCode=%d (%s)\n",
 				data->index, err->errorCode, err->resourceID, err->minorCode, err->majorCode, requestNames[err->majorCode]);
+			if (config.cacheFonts && err->majorCode == X_OpenFont)
+				forgetFailedFont(data, err->sequenceNumber);
 			break;
 		}
 
 		case X_Reply:
 		{
-			switch (data->notes[reply->generic.sequenceNumber])
+			unsigned char note = data->notes[reply->generic.sequenceNumber];
+			if (ofs < replySizes[noteRequests[note]])
+			{
+				log_debug("[%d] Reply to %s is too short (%zu < %d bytes), passing it on as-is\n",
+					data->index, requestNames[noteRequests[note]], ofs, replySizes[noteRequests[note]]);
+				break;
+			}
+			switch (note)
 			{
 				case Note_X_GetGeometry:
 				{
@@ -1497,6 +4227,42 @@ static bool handleServerData(X11ConnData* data)
 					break;
 				}
 
+				case Note_X_QueryPointer:
+				{
+					// The reply does not tell us whether the pointer is inside the window
+					// (and so whether we will see it move), so only events make the state valid.
+					CARD16 serial = reply->generic.sequenceNumber;
+					if (data->pointerQueries[serial % 64].serial == serial) // not overwritten by a later one
+						trackPointerWindow(data, data->pointerQueries[serial % 64].window);
+					break;
+				}
+
+				case Note_X_GetWindowAttributes_Pointer:
+				{
+					xGetWindowAttributesReply* r = (xGetWindowAttributesReply*)reply;
+					if (!data->pointerMaskKnown)
+					{
+						data->pointerClientMask = r->yourEventMask;
+						data->pointerMaskKnown = true;
+					}
+					break;
+				}
+
+				case Note_X_GetWindowAttributes_Root:
+				{
+					// Hide the PropertyChangeMask we selected ourselves (see selectRootProperties)
+					xGetWindowAttributesReply* r = (xGetWindowAttributesReply*)reply;
+					CARD16 serial = r->sequenceNumber;
+					if (data->rootQueries[serial % 64].serial == serial // not overwritten by a later one
+					 && !(data->rootEventMasks[data->rootQueries[serial % 64].root] & PropertyChangeMask))
+						r->yourEventMask &= ~PropertyChangeMask;
+					break;
+				}
+
+				case Note_X_QueryTree_Pointer:
+					pointerWindowParent(data, reply->tree.parent);
+					break;
+
 				case Note_X_InternAtom__NET_ACTIVE_WINDOW:
 				{
 					xInternAtomReply* r = &reply->atom;
@@ -1552,6 +4318,29 @@ static bool handleServerData(X11ConnData* data)
 					break;
 				}
 
+				case Note_X_QueryExtension_XKEYBOARD:
+				{
+					xQueryExtensionReply* r = &reply->extension;
+					log_debug2("  X_QueryExtension (XKEYBOARD): present=%d major_opcode=%d first_event=%d first_error=%d\n",
+						r->present, r->major_opcode, r->first_event, r->first_error);
+					if (r->present)
+					{
+						data->opcode_XKEYBOARD = r->major_opcode;
+						data->event_XKEYBOARD = r->first_event;
+					}
+					break;
+				}
+
+				case Note_X_QueryExtension_GLX:
+				{
+					xQueryExtensionReply* r = &reply->extension;
+					log_debug2("  X_QueryExtension (GLX): present=%d major_opcode=%d first_event=%d first_error=%d\n",
+						r->present, r->major_opcode, r->first_event, r->first_error);
+					if (r->present)
+						data->opcode_GLX = r->major_opcode;
+					break;
+				}
+
 				case Note_X_QueryExtension_Other:
 				{
 					xQueryExtensionReply* r = &reply->extension;
@@ -1572,7 +4361,7 @@ static bool handleServerData(X11ConnData* data)
 				case Note_X_XF86VidModeGetAllModeLines:
 				{
 					xXF86VidModeGetAllModeLinesReply* r = (xXF86VidModeGetAllModeLinesReply*)reply;
-					xXF86VidModeModeInfo* modeInfos = (xXF86VidModeModeInfo*)(data->buf + sz_xXF86VidModeGetAllModeLinesReply);
+					xXF86VidModeModeInfo* modeInfos = (xXF86VidModeModeInfo*)(data->serverBuf + sz_xXF86VidModeGetAllModeLinesReply);
 					for (size_t i=0; i<r->modecount; i++)
 					{
 						xXF86VidModeModeInfo* modeInfo = modeInfos + i;
@@ -1586,7 +4375,7 @@ static bool handleServerData(X11ConnData* data)
 				case Note_X_RRGetScreenInfo:
 				{
 					xRRGetScreenInfoReply* r = (xRRGetScreenInfoReply*)reply;
-					xScreenSizes* sizes = (xScreenSizes*)(data->buf+sz_xRRGetScreenInfoReply);
+					xScreenSizes* sizes = (xScreenSizes*)(data->serverBuf+sz_xRRGetScreenInfoReply);
 					for (size_t i=0; i<r->nSizes; i++)
 					{
 						xScreenSizes* size = sizes+i;
@@ -1600,7 +4389,7 @@ static bool handleServerData(X11ConnData* data)
 				case Note_X_RRGetScreenResources:
 				{
 					xRRGetScreenResourcesReply* r = (xRRGetScreenResourcesReply*)reply;
-					void* ptr = data->buf+sz_xRRGetScreenResourcesReply;
+					void* ptr = data->serverBuf+sz_xRRGetScreenResourcesReply;
 					ptr += r->nCrtcs * sizeof(CARD32);
 					ptr += r->nOutputs * sizeof(CARD32);
 					for (size_t i=0; i<r->nModes; i++)
@@ -1635,7 +4424,7 @@ static bool handleServerData(X11ConnData* data)
 				case Note_X_RRGetScreenResourcesCurrent: // Note: identical to RRGetScreenResources
 				{
 					xRRGetScreenResourcesCurrentReply* r = (xRRGetScreenResourcesCurrentReply*)reply;
-					void* ptr = data->buf+sz_xRRGetScreenResourcesCurrentReply;
+					void* ptr = data->serverBuf+sz_xRRGetScreenResourcesCurrentReply;
 					ptr += r->nCrtcs * sizeof(CARD32);
 					ptr += r->nOutputs * sizeof(CARD32);
 					for (size_t i=0; i<r->nModes; i++)
@@ -1652,7 +4441,7 @@ static bool handleServerData(X11ConnData* data)
 				case Note_X_XineramaQueryScreens:
 				{
 					xXineramaQueryScreensReply* r = (xXineramaQueryScreensReply*)reply;
-					xXineramaScreenInfo* screens = (xXineramaScreenInfo*)(data->buf+sz_XineramaQueryScreensReply);
+					xXineramaScreenInfo* screens = (xXineramaScreenInfo*)(data->serverBuf+sz_XineramaQueryScreensReply);
 					for (size_t i=0; i<r->number; i++)
 					{
 						xXineramaScreenInfo* screen = screens+i;
@@ -1675,6 +4464,11 @@ static bool handleServerData(X11ConnData* data)
 					break;
 				}
 
+				case Note_X_GetFontPath:
+					if (config.cacheFonts)
+						checkFontPath(data, reply, ofs);
+					break;
+
 				case Note_NV_GLX:
 				{
 #if 0
@@ -1682,7 +4476,7 @@ static bool handleServerData(X11ConnData* data)
 					static int counter = 0;
 					sprintf(fn, "/tmp/hax11-NV-%d-rsp-%d", reply->generic.sequenceNumber, counter++);
 					FILE* f = fopen(fn, "wb");
-					fwrite(data->buf, 1, ofs, f);
+					fwrite(data->serverBuf, 1, ofs, f);
 					fclose(f);
 #endif
 					break;
@@ -1748,53 +4542,170 @@ static bool handleServerData(X11ConnData* data)
 				bool isButton = reply->generic.type == ButtonPress || reply->generic.type == ButtonRelease;
 				int kind = isButton ? MAP_KIND_BUTTON : MAP_KIND_KEY;
 
-				bool found = false;
-				for (struct MapConfig *map = config.maps; map; map = map->next)
-					if (map->from.kind == kind && map->from.code == reply->event.u.u.detail)
+				const struct MapTable *table = &mapTables[kind][reply->event.u.u.detail];
+				if (table->count)
+				{
+					xEvent injected[table->count];
+					for (unsigned int i = 0; i < table->count; i++)
 					{
+						const struct MapInput *to = &table->targets[i];
 						static const char *kindNames[] = { "key", "button" };
 						log_debug("Mapping %s %u to %s %u\n",
-							kindNames[map->from.kind], map->from.code,
-							kindNames[map->to.kind], map->to.code);
-
-						xEvent injected = reply->event;
-						injected.u.u.type = isPress
-							? map->to.kind == MAP_KIND_BUTTON ? ButtonPress : KeyPress
-							: map->to.kind == MAP_KIND_BUTTON ? ButtonRelease : KeyRelease;
-						injected.u.u.detail = map->to.code;
-						injectEvent(data, &injected);
-						found = true;
+							kindNames[kind], reply->event.u.u.detail,
+							kindNames[to->kind], to->code);
+
+						injected[i] = reply->event;
+						injected[i].u.u.type = isPress
+							? to->kind == MAP_KIND_BUTTON ? ButtonPress : KeyPress
+							: to->kind == MAP_KIND_BUTTON ? ButtonRelease : KeyRelease;
+						injected[i].u.u.detail = to->code;
 					}
+					injectEvents(data, injected, table->count);
+
+					unsigned char *held = &data->mappedDown[kind][reply->event.u.u.detail / 8];
+					unsigned char bit = 1 << (reply->event.u.u.detail % 8);
+					if (isPress && !(*held & bit))
+						data->mappedHeld++;
+					else
+					if (!isPress && (*held & bit))
+						data->mappedHeld--;
+					*held = isPress ? *held | bit : *held & ~bit;
 
-				if (found)
-				{
 					log_debug("Filtering out mapped input event\n");
 					return true;
 				}
 			}
 			break;
+
+		case ConfigureNotify:
+			if (trackingWindows())
+				windowConfigured(data, reply->event.u.configureNotify.window,
+					reply->event.u.configureNotify.x, reply->event.u.configureNotify.y,
+					reply->event.u.configureNotify.width, reply->event.u.configureNotify.height,
+					reply->event.u.configureNotify.borderWidth);
+			break;
+
+		case ConfigureNotify | 0x80:
+			// Sent by the window manager for managed windows. The position is in
+			// root coordinates, so it is only usable while the window is not in a frame.
+			if (trackingWindows())
+			{
+				struct WindowInfo *w = findWindow(data, reply->event.u.configureNotify.window);
+				if (w && w->managed)
+				{
+					bool inRoot = findRoot(data, w->parent) >= 0;
+					windowConfigured(data, w->id,
+						inRoot ? reply->event.u.configureNotify.x : w->x,
+						inRoot ? reply->event.u.configureNotify.y : w->y,
+						reply->event.u.configureNotify.width, reply->event.u.configureNotify.height,
+						reply->event.u.configureNotify.borderWidth);
+				}
+			}
+			break;
+
+		case CreateNotify:
+			if (trackingWindows() && !findWindow(data, reply->event.u.createNotify.window))
+			{
+				struct WindowInfo *parent = findWindow(data, reply->event.u.createNotify.parent);
+				if (parent)
+					parent->foreignChildren = true;
+			}
+			break;
+
+		case ReparentNotify:
+			if (trackingWindows())
+			{
+				struct WindowInfo *w = findWindow(data, reply->event.u.reparent.window);
+				if (w)
+				{
+					setParent(data, w, reply->event.u.reparent.parent);
+					w->x = reply->event.u.reparent.x;
+					w->y = reply->event.u.reparent.y;
+					updateTracking(data, w);
+				}
+				else
+				{
+					struct WindowInfo *parent = findWindow(data, reply->event.u.reparent.parent);
+					if (parent)
+						parent->foreignChildren = true;
+				}
+			}
+			break;
+
+		case GravityNotify:
+			if (trackingWindows())
+			{
+				struct WindowInfo *w = findWindow(data, reply->event.u.gravity.window);
+				if (w)
+				{
+					w->x = reply->event.u.gravity.x;
+					w->y = reply->event.u.gravity.y;
+				}
+			}
+			break;
+
+		case DestroyNotify:
+			if (trackingWindows())
+				removeWindow(data, reply->event.u.destroyNotify.window, true);
+			break;
+
+		case PropertyNotify:
+		case PropertyNotify | 0x80: // sent with SendEvent to the windows selecting it, such as ours
+			if (config.cacheRootProperties)
+			{
+				int root = findRoot(data, reply->event.u.property.window);
+				if (root >= 0)
+				{
+					log_debug2("PropertyNotify: Invalidating cached property %"PRIuCARD32"\n", reply->event.u.property.atom);
+					cacheInvalidate(data->propertyCache, reply->event.u.property.window, reply->event.u.property.atom);
+					if (!(data->rootEventMasks[root] & PropertyChangeMask))
+					{
+						log_debug2("Filtering out PropertyNotify event\n");
+						return true;
+					}
+				}
+			}
+			break;
+
+		case MappingNotify:
+			if (config.cacheKeymap)
+			{
+				log_debug2("MappingNotify: Invalidating keymap cache\n");
+				cacheInvalidate(&keymapCache, 0, 0);
+			}
+			break;
+
+		default:
+			if (data->opcode_XKEYBOARD && reply->generic.type == data->event_XKEYBOARD)
+			{
+				xkbAnyEvent* ev = (xkbAnyEvent*)reply;
+				if (config.cacheKeymap
+				 && (ev->xkbType == XkbNewKeyboardNotify
+				  || ev->xkbType == XkbMapNotify
+				  || ev->xkbType == XkbNamesNotify))
+				{
+					log_debug2("XKB notify %d: Invalidating keymap cache\n", ev->xkbType);
+					cacheInvalidate(&keymapCache, 0, 0);
+				}
+			}
+			break;
 	}
 
-	if (config.debug >= 2 && config.actualX && config.actualY && memmem(data->buf, ofs, &config.actualX, 2) && memmem(data->buf, ofs, &config.actualY, 2))
+	if (config.debug >= 2 && config.actualX && config.actualY && memmem(data->serverBuf, ofs, &config.actualX, 2) && memmem(data->serverBuf, ofs, &config.actualY, 2))
 		log_debug2("   Found actualW/H in output! ----------------------------------------------------------------------------------------------\n");
 
 	if (serialIsValid)
 	{
-		while (data->serialLast != reply->generic.sequenceNumber)
-		{
-			data->skip[data->serialLast] = false;
-			data->serialLast++;
-			if (data->skip[data->serialLast])
-			{
-				data->serialDelta++;
-				log_debug2("  Incrementing serialDelta for injected reply (now at %d)\n", data->serialDelta);
-			}
-		}
+		serialAdvance(data, reply);
+
+		if (reply->generic.type < 2) // reply or error only, not event
+			data->serialComplete = reply->generic.sequenceNumber;
 
-		if (reply->generic.type < 2 && // reply or error only, not event
+		if (reply->generic.type < 2 &&
 			data->skip[reply->generic.sequenceNumber])
 		{
 			log_debug2("  Skipping this reply\n");
+			sendHeldReplies(data, reply->generic.sequenceNumber);
 			return true;
 		}
 
@@ -1803,39 +4714,299 @@ static bool handleServerData(X11ConnData* data)
 		/* log_debug2("  [server: %d] -> [client: %d]\n", oldSerial, reply->generic.sequenceNumber); */
 	}
 
-	if (!sendAll(&conn, data->buf, ofs)) return false;
+	if (!sendAll(&conn, data->serverBuf, ofs)) return false;
+	if (reply->generic.type > X_Reply)
+		eventsForwarded(data, 1);
 
 	return true;
 }
 
-static void* workThreadProc(void* dataPtr)
+// ****************************************************************************
+
+// DuplexThreads mode.
+// Each direction of a connection is relayed by its own thread, so that large
+// uploads and event delivery proceed in parallel. The threads share only the
+// per-serial bookkeeping (notes, skip, answered - written by the client
+// thread for a request before it is sent, read by the server thread once the
+// server has seen that request) and the extension opcodes (learned by the
+// server thread before the QueryExtension reply is passed on). Features which
+// answer requests locally, keep window or pointer state, or inject requests
+// from the server side need both directions in one thread, so with any of
+// them enabled the connection is relayed by a single thread as usual.
+
+static bool duplexPossible()
 {
-	X11ConnData* data = (X11ConnData*)dataPtr;
+	return config.duplexThreads
+		&& !config.cacheKeymap
+		&& !config.cacheGLX
+		&& !config.cacheFonts
+		&& !config.cacheRootProperties
+		&& !config.prefetch
+		&& !config.mirrorGeometry
+		&& !config.trackPointer
+		&& !config.confineMouse
+		&& !config.noResolutionChange;
+}
 
-	bufSize(&data->buf, &data->bufLen, 1<<16);
+// ****************************************************************************
+
+// Relay daemon.
+// With Daemon=1, lib.c passes intercepted connections to a per-user daemon
+// (the server binary run with --daemon) instead of relaying them in the
+// application's process. The daemon receives both sockets over a unix
+// socket (SCM_RIGHTS), along with the following:
+
+struct DaemonHandoff
+{
+	int display;
+	char profile[256]; // as returned by getProfileName in the application
+};
+
+/// Seconds either side of a handoff waits for the other (see sendHandoff)
+#define HANDOFF_TIMEOUT 5
+
+/// The relay daemon's socket lives in a directory only this user can access.
+/// Without XDG_RUNTIME_DIR, that is /tmp/hax11-UID, which the daemon creates.
+static bool daemonSocketPath(char* buf, size_t size, bool create)
+{
+	char dir[108];
+	const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+	if (runtimeDir)
+		snprintf(dir, sizeof(dir), "%s", runtimeDir);
+	else
+	{
+		snprintf(dir, sizeof(dir), "/tmp/hax11-%d", (int)getuid());
+		if (create)
+			mkdir(dir, 0700);
+	}
+
+	struct stat st;
+	if (lstat(dir, &st) != 0)
+	{
+		log_debug("No relay daemon directory %s\n", dir);
+		return false;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+	{
+		log_error("%s is not a private directory, not using the relay daemon\n", dir);
+		return false;
+	}
+	snprintf(buf, size, "%s/hax11.sock", dir);
+	return true;
+}
+
+// ****************************************************************************
+
+// LatencyMode.
+// Waking up from a blocking poll takes a trip through the scheduler, which
+// adds to the latency of every event. In LatencyMode, the relay thread first
+// checks its sockets without blocking for a while, and only then blocks.
+// The window adapts: it grows while data keeps arriving within it, and
+// shrinks while it does not, so an idle connection mostly sleeps.
+
+#define SPIN_MIN_NS    5000
+#define SPIN_MAX_NS  500000
+#define RELAY_NICE      -10
+
+/// Busy-poll fds for up to *spinNs. Returns like poll, 0 if nothing arrived.
+static int spinPoll(struct pollfd* fds, nfds_t nfds, uint64_t* spinNs)
+{
+	uint64_t deadline = monotonicNs() + *spinNs;
+	do
+	{
+		int ready = poll(fds, nfds, 0);
+		if (ready != 0)
+		{
+			if (ready > 0 && *spinNs < SPIN_MAX_NS)
+				*spinNs *= 2;
+			return ready;
+		}
+	} while (monotonicNs() < deadline);
+
+	if (*spinNs > SPIN_MIN_NS)
+		*spinNs /= 2;
+	return 0;
+}
+
+/// Apply RelayCPU and LatencyMode to the calling relay thread.
+static void tuneRelayThread()
+{
+	if (config.relayCPU >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(config.relayCPU, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) // 0 is the calling thread
+			log_debug("Could not pin relay thread to CPU %d: %s\n", config.relayCPU, strerror(errno));
+	}
+
+	if (config.latencyMode)
+	{
+		// Linux nice values are per-thread; 0 is the calling thread.
+		// Needs CAP_SYS_NICE or a high enough RLIMIT_NICE.
+		if (setpriority(PRIO_PROCESS, 0, RELAY_NICE) < 0)
+			log_debug("Could not raise relay thread priority: %s\n", strerror(errno));
+	}
+}
+
+// ****************************************************************************
+
+// Configuration reload.
+// One thread per process watches the profiles directory, and increments
+// configGeneration when something in it changes. Each relay thread owns its
+// configuration (see config), and compares the generation with the one it
+// loaded after waking up for new data; when it differs, it loads its
+// profile again and frees the old configuration, which no other thread uses.
+// Options which decide how the connection is relayed, or which collect
+// state from the start of the connection, keep their values; changes to
+// them apply to new connections.
+
+#define CONNECTION_OPTIONS(X) \
+	X(dumb) \
+	X(duplexThreads) \
+	X(relayCPU) \
+	X(latencyMode) \
+	X(coalesceConfigure) \
+	X(cacheKeymap) \
+	X(cacheGLX) \
+	X(cacheFonts) \
+	X(cacheRootProperties) \
+	X(prefetch) \
+	X(mirrorGeometry) \
+	X(trackPointer) \
+	X(confineMouse) \
+	X(noResolutionChange)
+
+/// Editors may write a profile in several steps; wait this long for more
+/// changes before reloading.
+#define CONFIG_SETTLE_MS 100
+
+/// Whether the profiles the calling thread loaded its configuration from
+/// have changed since. Writes to other profiles also bump configGeneration.
+static bool configChanged()
+{
+	char dir[1024];
+	if (!getProfilesPath(dir, sizeof(dir), false))
+		return false;
+
+	char name[1024] = {0};
+	threadProfileName(name, sizeof(name));
+
+	char fn[2048];
+	struct FileStamp stamp;
+	snprintf(fn, sizeof(fn), "%s/default", dir);
+	fileStamp(fn, &stamp);
+	if (!sameStamp(&stamp, &configStamps[0]))
+		return true;
+	snprintf(fn, sizeof(fn), "%s/%s", dir, name);
+	fileStamp(fn, &stamp);
+	return !sameStamp(&stamp, &configStamps[1]);
+}
+
+static void reloadConfig(X11ConnData* data)
+{
+	if (!configChanged())
+	{
+		configLoadedGeneration = __atomic_load_n(&configGeneration, __ATOMIC_ACQUIRE);
+		return;
+	}
+
+	struct Config old = config; // for the options only; freeConfig frees the lists
+	freeConfig();
+	needConfig();
+
+	#define KEEP_OPTION(x) config.x = old.x;
+	CONNECTION_OPTIONS(KEEP_OPTION)
+	#undef KEEP_OPTION
+	compileRequestActions();
+	compileEventActions();
+	log_debug("[%d] Configuration reloaded\n", data->index);
+}
+
+static void* configWatcherProc(void* dirPtr)
+{
+	const char *dir = (const char*)dirPtr;
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0)
+	{
+		log_debug("Cannot watch %s for changes: %s\n", dir, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (read(fd, buf, sizeof(buf)) > 0)
+	{
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		while (poll(&p, 1, CONFIG_SETTLE_MS) > 0 && read(fd, buf, sizeof(buf)) > 0)
+			continue;
+
+		// Bring the profile index up to date here, rather than in the first
+		// relay thread to reload.
+		freeConfig();
+		needConfig();
+		log_debug("Profiles changed, reloading configuration\n");
+		__atomic_add_fetch(&configGeneration, 1, __ATOMIC_RELEASE);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void startConfigWatcher()
+{
+	static char started = 0;
+	if (__atomic_test_and_set(&started, __ATOMIC_RELAXED))
+		return;
+	static char dir[1024];
+	if (getProfilesPath(dir, sizeof(dir), false))
+		startThread(configWatcherProc, dir);
+}
+
+/// Most server messages handled in one go before the next client request,
+/// so that a server flooding us with events can't stall the client's requests.
+#define SERVER_DRAIN_MAX 64
 
-	fd_set readSet;
-	FD_ZERO(&readSet);
+/// Relay data until either side closes the connection. A thread in
+/// DuplexThreads mode only handles one direction.
+static void relay(X11ConnData* data, bool fromClient, bool fromServer)
+{
+	tuneRelayThread();
+	uint64_t spinNs = SPIN_MAX_NS / 4;
 
 	struct pollfd fds[2] = {
 		{
 			.fd = data->client,
-			.events = POLLRDNORM,
 		},
 		{
 			.fd = data->server,
-			.events = POLLRDNORM,
 		},
 	};
 
 	while (true)
 	{
-		if (poll(fds, 2, -1) < 0)
+		// Only read from a side while there is room to pass its data on.
+		fds[0].events = (fromClient && !queueFull(&data->toServer) ? POLLRDNORM : 0) | (fromServer && queued(&data->toClient) ? POLLOUT : 0);
+		fds[1].events = (fromServer && !queueFull(&data->toClient) ? POLLRDNORM : 0) | (fromClient && queued(&data->toServer) ? POLLOUT : 0);
+
+		int ready = config.latencyMode ? spinPoll(fds, 2, &spinNs) : 0;
+		if (ready == 0)
+			ready = poll(fds, 2, -1);
+		if (ready < 0)
 		{
+			if (errno == EINTR)
+				continue;
 			log_error("select() failed");
 			break;
 		}
 
+		// The release of a mapped key or button must go through the same
+		// mapping as its press, so the thread relaying events waits until
+		// all of them are released.
+		if (__atomic_load_n(&configGeneration, __ATOMIC_ACQUIRE) != configLoadedGeneration
+		 && !(fromServer && data->mappedHeld))
+			reloadConfig(data);
+
 		if (fds[0].revents & (POLLERR|POLLHUP|POLLNVAL))
 		{
 			log_debug("Error on client socket\n");
@@ -1847,24 +5018,246 @@ static void* workThreadProc(void* dataPtr)
 			break;
 		}
 
-		if (fds[0].revents)
+		if ((fds[0].revents & POLLOUT) && !flushQueue(&data->toClient))
+		{
+			log_debug("Error writing to client\n");
+			break;
+		}
+		if ((fds[1].revents & POLLOUT) && !flushQueue(&data->toServer))
+		{
+			log_debug("Error writing to server\n");
+			break;
+		}
+
+		// Server first, so that input events never wait behind client requests:
+		// drain what the server has sent before taking the next request.
+		if (config.debug && fromServer)
+			data->serverReadyAt = monotonicNs();
+		bool serverDone = false;
+		int budget = SERVER_DRAIN_MAX;
+		if (fds[1].revents & POLLRDNORM)
+			do
+				if (!handleServerData(data))
+				{
+					log_debug("End of server data\n");
+					serverDone = true;
+					break;
+				}
+			while (--budget && !queueFull(&data->toClient) && readable(data->server));
+		if (serverDone)
+			break;
+
+		if (fds[0].revents & POLLRDNORM)
 			if (!handleClientData(data))
 			{
 				log_debug("End of client data\n");
 				break;
 			}
-		if (fds[1].revents)
-			if (!handleServerData(data))
-			{
-				log_debug("End of server data\n");
-				break;
-			}
 	}
 
+	if (fromServer)
+		flushQueue(&data->toClient); // e.g. an error the server sent before closing
+}
+
+/// Connections taken over by receiveConnection which are still being relayed
+static int receivedConnections = 0;
+/// No more connections will be received, so the process can exit with the last one (see stopReceiving)
+static bool receivingStopped = false;
+
+/// Called by each relay thread when it is done. The last one cleans up.
+static void relayDone(X11ConnData* data)
+{
+	if (__atomic_sub_fetch(&data->threads, 1, __ATOMIC_ACQ_REL) > 0)
+	{
+		// Wake up the thread relaying the other direction
+		shutdown(data->client, SHUT_RDWR);
+		shutdown(data->server, SHUT_RDWR);
+		return;
+	}
+
+	if (config.compressMotion)
+		log_debug("Merged %lu of %lu MotionNotify events\n", data->motionMerged, data->motionEvents);
+	if (config.compressConfigure)
+		log_debug("Merged %lu of %lu ConfigureNotify and %lu of %lu Expose events\n",
+			data->configureMerged, data->configureEvents, data->exposeMerged, data->exposeEvents);
+	if (data->latencyEvents)
+		log_debug("Forwarded %lu events, latency average %.1f us, maximum %.1f us\n",
+			data->latencyEvents, data->latencyTotal / 1000.0 / data->latencyEvents, data->latencyMax / 1000.0);
 	log_debug("Exiting work thread.\n");
+	free(data->buf);
+	free(data->serverBuf);
+	free(data->toClient.buf);
+	free(data->toServer.buf);
+	free(data->heldRequests.buf);
+	free(data->slice);
+	for (int i = 0; i < 256; i++)
+		while (data->windows[i])
+		{
+			struct WindowInfo *next = data->windows[i]->next;
+			free(data->windows[i]);
+			data->windows[i] = next;
+		}
+	while (data->fonts)
+	{
+		struct FontName *next = data->fonts->next;
+		free(data->fonts);
+		data->fonts = next;
+	}
+	while (data->prefetched)
+	{
+		struct Prefetched *next = data->prefetched->next;
+		free(data->prefetched);
+		data->prefetched = next;
+	}
+	if (data->propertyCache)
+		cacheFree(data->propertyCache);
+	while (data->heldHead)
+	{
+		struct HeldReplies *next = data->heldHead->next;
+		free(data->heldHead->buf);
+		free(data->heldHead);
+		data->heldHead = next;
+	}
+	while (data->storeHead)
+	{
+		struct PendingStore *next = data->storeHead->next;
+		free(data->storeHead->reply);
+		free(data->storeHead);
+		data->storeHead = next;
+	}
 	shutdown(data->client, SHUT_RDWR);
 	shutdown(data->server, SHUT_RDWR);
 	close(data->client);
 	close(data->server);
+	bool received = data->received;
+	free(data);
+	if (received
+	 && __atomic_sub_fetch(&receivedConnections, 1, __ATOMIC_SEQ_CST) == 0
+	 && __atomic_load_n(&receivingStopped, __ATOMIC_SEQ_CST))
+		_exit(0);
+}
+
+/// Load the configuration for the connection in the calling relay thread.
+static void connectionConfig(X11ConnData* data)
+{
+	profileOverride = data->profile[0] ? data->profile : NULL;
+	needConfig();
+}
+
+static void* clientThreadProc(void* dataPtr)
+{
+	X11ConnData* data = (X11ConnData*)dataPtr;
+	connectionConfig(data);
+	relay(data, true, false);
+	relayDone(data);
+	freeConfig();
+	return NULL;
+}
+
+static void* workThreadProc(void* dataPtr)
+{
+	X11ConnData* data = (X11ConnData*)dataPtr;
+	connectionConfig(data);
+	startConfigWatcher();
+
+	bufSize(&data->buf, &data->bufLen, 1<<16);
+	bufSize(&data->serverBuf, &data->serverBufLen, 1<<16);
+
+	// Neither side can hold up the other: writes which don't go through
+	// right away are queued and flushed when the socket becomes writable.
+	fcntl(data->client, F_SETFL, fcntl(data->client, F_GETFL) | O_NONBLOCK);
+	fcntl(data->server, F_SETFL, fcntl(data->server, F_GETFL) | O_NONBLOCK);
+	data->toServer.fd = data->server;
+	data->toServer.dir = '<';
+	data->toClient.fd = data->client;
+	data->toClient.dir = '>';
+
+	data->duplex = duplexPossible();
+	data->threads = data->duplex ? 2 : 1;
+	if (data->duplex)
+	{
+		log_debug("Relaying client data in a separate thread\n");
+		startThread(clientThreadProc, data);
+	}
+
+	relay(data, !data->duplex, true);
+	relayDone(data);
+	freeConfig();
 	return NULL;
 }
+
+/// Take over a connection passed by lib.c on fd (see DaemonHandoff), and
+/// relay it on a new thread. Returns false at the end of the stream.
+static bool receiveConnection(int fd)
+{
+	struct ucred cred;
+	socklen_t credLength = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLength) < 0 || cred.uid != getuid())
+	{
+		log_error("Rejecting connection from another user\n");
+		return false;
+	}
+
+	struct DaemonHandoff handoff;
+	int fds[2];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { .iov_base = &handoff, .iov_len = sizeof(handoff) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len <= 0)
+		return false;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+	{
+		log_error("Bad connection handoff\n");
+		return false;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	if (len != sizeof(handoff))
+	{
+		log_error("Bad connection handoff\n");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	handoff.profile[sizeof(handoff.profile) - 1] = 0;
+
+	X11ConnData* data = calloc(1, sizeof(X11ConnData));
+	static int index = 0;
+	data->index = index++;
+	data->display = handoff.display;
+	data->server = fds[0];
+	data->client = fds[1];
+	data->received = true;
+	strcpy(data->profile, handoff.profile);
+
+	// The sender gives up if the acknowledgement does not arrive in time, and
+	// otherwise confirms that it has. It does so right away, so wait longer
+	// than it does, and end the stream if it did give up.
+	char ack = 0, confirm;
+	struct timeval timeout, handoffTimeout = { .tv_sec = 2 * HANDOFF_TIMEOUT };
+	socklen_t timeoutLength = sizeof(timeout);
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &timeoutLength) < 0)
+		timeout = (struct timeval){};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &handoffTimeout, sizeof(handoffTimeout));
+	bool confirmed = send(fd, &ack, 1, MSG_NOSIGNAL) == 1
+		&& recv(fd, &confirm, 1, 0) == 1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (!confirmed)
+	{
+		log_error("Connection handoff abandoned by the sender\n");
+		close(data->server);
+		close(data->client);
+		free(data);
+		return false;
+	}
+	log_debug("Relaying connection %d for %s\n", data->index, data->profile);
+	__atomic_add_fetch(&receivedConnections, 1, __ATOMIC_SEQ_CST);
+	startThread(workThreadProc, data);
+	return true;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Generates protocol.h - request name and size tables for the core
+# protocol and the extensions hax11 knows about - from the installed
+# X protocol headers (the same ones hax11 is built against).
+# Field offsets are not generated: the handlers use the structs from the
+# same headers, so the compiler already has them.
+# Usage: genproto.sh > protocol.h
+set -eu
+
+CC=${CC:-gcc}
+
+# Print "name value" for each "#define <prefix>Name <number>" in the header,
+# in the order they appear in it.
+defines() {
+	echo "#include <$1>" | $CC -E -dD - |
+		awk -v prefix="$2" -v exclude="${3:-^$}" '
+			$1 == "#define" && $2 ~ "^(" prefix ")[A-Za-z0-9]+$" && $2 !~ exclude && $3 ~ /^[0-9]+$/ { print $2, $3 }'
+}
+
+# Emit a name table indexed by opcode. The first name for an opcode wins
+# (later ones are usually compatibility aliases).
+table() {
+	name=$1 size=$2 strip=$3
+	echo "static const char *$name[$size] ="
+	echo "{"
+	awk -v strip="$strip" '
+		!($2 in seen) { seen[$2] = 1; sub("^(" strip ")", "", $1); print "\t[" $2 "] = \"" $1 "\"," }'
+	echo "};"
+	echo
+}
+
+echo "// Generated by genproto.sh from the X protocol headers - do not edit."
+echo
+
+core=$(defines X11/Xproto.h X_ '^X_(Reply|Error)$')
+echo "$core" | table requestNames 256 X_
+
+# Fixed part of each core request and of its reply, where the headers
+# define their sizes
+sizes=$(echo "#include <X11/Xproto.h>" | $CC -E -dM - | awk '$1 == "#define" && $2 ~ /^sz_x[A-Za-z]+(Req|Reply)$/ { print $2 }')
+sizeTable() {
+	echo "static const unsigned char $1[128] ="
+	echo "{"
+	echo "$core" | while read -r define opcode; do
+		size=sz_x${define#X_}$2
+		if echo "$sizes" | grep -qx "$size"; then
+			printf '\t[%s] = %s,\n' "$opcode" "$size"
+		fi
+	done
+	echo "};"
+	echo
+}
+sizeTable requestSizes Req
+sizeTable replySizes Reply
+
+defines X11/extensions/xf86vmproto.h X_XF86VidMode | table xf86VidModeRequestNames 256 X_XF86VidMode
+defines X11/extensions/randrproto.h X_RR | table randrRequestNames 256 X_RR
+defines X11/extensions/panoramiXproto.h 'X_PanoramiX|X_Xinerama' | table xineramaRequestNames 256 'X_PanoramiX|X_'
+defines X11/extensions/XKBproto.h X_kb | table xkbRequestNames 256 X_kb
+defines GL/glxproto.h X_GLX '^X_GLXvop_' | table glxRequestNames 256 X_GLX
@@ -14,6 +14,7 @@ static void getProfileName(char *p, size_t size)
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <sys/syscall.h>
 
 #define NEXT(handle, path, func) ({										\
 			static typeof(&func) pfunc = NULL;                           \
@@ -55,6 +56,219 @@ static void fail(int err, const char* func)
 static void* libc = NULL;
 static void* pthread = NULL;
 
+static void startThread(void* (*proc)(void*), void* arg)
+{
+	pthread_attr_t attr = {};
+	CHECKRET(NEXT(pthread, LIBPTHREAD_SO, pthread_attr_init)(&attr),
+		ret == 0, ret, "pthread_attr_init");
+	CHECKRET(NEXT(pthread, LIBPTHREAD_SO, pthread_attr_setdetachstate)(&attr, PTHREAD_CREATE_DETACHED),
+		ret == 0, ret, "pthread_attr_setdetachstate");
+
+	pthread_t thread;
+	CHECKRET(NEXT(pthread, LIBPTHREAD_SO, pthread_create)
+		(&thread, &attr, proc, arg),
+		ret == 0, ret, "pthread_create");
+	NEXT(pthread, LIBPTHREAD_SO, pthread_attr_destroy)(&attr);
+}
+
+/// Send the connection's sockets and a DaemonHandoff over fd to a process
+/// running receiveConnection, and wait until it owns them. On failure, the
+/// stream is out of step and must not be used again.
+static bool sendHandoff(int fd, X11ConnData* data)
+{
+	struct DaemonHandoff handoff = { .display = data->display };
+	getProfileName(handoff.profile, sizeof(handoff.profile));
+
+	int fds[2] = { data->server, data->client };
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	struct iovec iov = { .iov_base = &handoff, .iov_len = sizeof(handoff) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	// The receiver acknowledges with one byte once it has the connection, and
+	// only starts relaying it once we confirm with another, so that a late
+	// acknowledgement can't leave both processes relaying it.
+	// Don't wait forever on a receiver that is stuck.
+	struct timeval timeout = { .tv_sec = HANDOFF_TIMEOUT };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	char ack, confirm = 0;
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(handoff)
+		&& recv(fd, &ack, 1, 0) == 1
+		&& send(fd, &confirm, 1, MSG_NOSIGNAL) == 1;
+}
+
+/// Pass the connection to the relay daemon. Returns false if it is not running.
+static bool handOff(X11ConnData* data)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (!daemonSocketPath(address.sun_path, sizeof(address.sun_path), false))
+		return false;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	if (NEXT(libc, LIBC_SO, connect)(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+	{
+		log_debug("No relay daemon at %s, relaying in-process\n", address.sun_path);
+		close(fd);
+		return false;
+	}
+
+	// Only hand the connection to a daemon run by the same user
+	struct ucred cred;
+	socklen_t credLength = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLength) < 0 || cred.uid != getuid())
+	{
+		log_error("Relay daemon at %s belongs to another user, relaying in-process\n", address.sun_path);
+		close(fd);
+		return false;
+	}
+
+	bool ok = sendHandoff(fd, data);
+	close(fd);
+	if (!ok)
+		log_debug("Relay daemon did not take the connection, relaying in-process\n");
+	return ok;
+}
+
+// ****************************************************************************
+
+/// Close fds [first, last], using close_range where the kernel has it.
+static void closeRange(unsigned first, unsigned last)
+{
+	if (first > last)
+		return;
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, first, last, 0) == 0)
+		return;
+#endif
+	struct rlimit r;
+	if (getrlimit(RLIMIT_NOFILE, &r) < 0)
+		return;
+	if (last >= r.rlim_cur)
+		last = r.rlim_cur - 1;
+	for (unsigned n = first; n <= last && n >= first; n++)
+		close(n); // Ignore error
+}
+
+/// Close everything except stdio and the two given fds.
+static void closeOtherFds(int keep1, int keep2)
+{
+	unsigned lo = keep1 < keep2 ? keep1 : keep2;
+	unsigned hi = keep1 < keep2 ? keep2 : keep1;
+	closeRange(3, lo - 1);
+	closeRange(lo + 1, hi - 1);
+	closeRange(hi + 1, ~0U);
+}
+
+/// Socket to the Fork=1 relay helper, or -1 if it has not been started.
+static int helperFd = -1;
+static volatile char helperLock = 0;
+
+/// Exit once the received connections are done. Other threads, such as the
+/// configuration watcher, would otherwise keep the process alive.
+static void stopReceiving()
+{
+	__atomic_store_n(&receivingStopped, true, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&receivedConnections, __ATOMIC_SEQ_CST) == 0)
+		_exit(0);
+}
+
+/// Fork the relay helper: a process which relays the connections passed to it
+/// by connect() (with sendHandoff), until this process exits or execs and all
+/// of its connections are closed.
+/// This forks the whole process once, so it is best done early, while it is
+/// still small (see the constructor below).
+static void startHelper()
+{
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+		return;
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		close(pair[0]);
+		close(pair[1]);
+		return;
+	}
+	if (pid == 0)
+	{
+		// Double-fork, so that the helper is not our child
+		if (fork() != 0)
+			_exit(0);
+		closeOtherFds(pair[1], pair[1]);
+		log_debug("Relay helper %d running\n", getpid());
+		while (receiveConnection(pair[1]))
+			continue;
+		// Keep relaying the remaining connections; the process exits with
+		// the last relay thread.
+		close(pair[1]);
+		stopReceiving();
+		NEXT(pthread, LIBPTHREAD_SO, pthread_exit)(NULL);
+	}
+
+	close(pair[1]);
+	CHECKRET(waitpid(pid, NULL, 0),
+		ret >= 0, errno, "waitpid");
+	helperFd = pair[0];
+}
+
+/// Pass the connection to the relay helper, starting it if needed.
+/// Returns false if that did not work.
+static bool handOffToHelper(X11ConnData* data)
+{
+	spinLock(&helperLock);
+	if (helperFd < 0)
+	{
+		log_debug("Starting relay helper late\n");
+		startHelper();
+	}
+	bool ok = helperFd >= 0 && sendHandoff(helperFd, data);
+	if (!ok && helperFd >= 0)
+	{
+		// Let it finish its connections and exit; the next one starts a new helper.
+		close(helperFd);
+		helperFd = -1;
+	}
+	spinUnlock(&helperLock);
+	if (!ok)
+		log_debug("Relay helper did not take the connection\n");
+	return ok;
+}
+
+/// Start the Fork=1 relay helper as soon as the library is loaded.
+/// Only programs with a profile of their own are considered here, so that
+/// everything else started with hax11 preloaded is not slowed down (or
+/// given an empty profile); the rest start it on their first connection.
+__attribute__((constructor))
+static void startHelperEarly()
+{
+	char buf[1024] = {0};
+	char *home = getenv("HOME");
+	if (!home)
+		return;
+	int len = snprintf(buf, sizeof(buf), "%s/.config/hax11/profiles/", home);
+	if (len < 0 || len >= (int)sizeof(buf))
+		return;
+	getProfileName(buf + len, sizeof(buf) - len);
+	if (access(buf, F_OK) != 0)
+		return;
+
+	needConfig();
+	if (config.enable && config.fork)
+		startHelper();
+}
+
 int connect(int socket, const struct sockaddr *address,
 	socklen_t address_len)
 {
@@ -84,6 +298,7 @@ int connect(int socket, const struct sockaddr *address,
 					X11ConnData* data = calloc(1, sizeof(X11ConnData));
 					static int index = 0;
 					data->index = index++;
+					data->display = atoi(path + 16);
 					data->server = dup(socket);
 					data->client = pair[0];
 					CHECKRET(dup2(pair[1], socket),
@@ -91,6 +306,24 @@ int connect(int socket, const struct sockaddr *address,
 					CHECKRET(close(pair[1]),
 						ret == 0, errno, "close");
 
+					if (config.daemon && handOff(data))
+					{
+						log_debug("Connection handed off to the relay daemon\n");
+						close(data->server);
+						close(data->client);
+						free(data);
+						return connect_result;
+					}
+
+					if (config.fork && handOffToHelper(data))
+					{
+						log_debug("Connection handed off to the relay helper\n");
+						close(data->server);
+						close(data->client);
+						free(data);
+						return connect_result;
+					}
+
 					if (config.fork)
 					{
 						log_debug("Forking...\n");
@@ -109,13 +342,7 @@ int connect(int socket, const struct sockaddr *address,
 								exit(0);
 							}
 							log_debug("In child, double-fork OK\n");
-							struct rlimit r;
-							CHECKRET(getrlimit(RLIMIT_NOFILE, &r),
-								ret >= 0, errno, "getrlimit");
-
-							for (int n=3; n<(int)r.rlim_cur; n++)
-								if (n != data->server && n != data->client)
-									close(n); // Ignore error
+							closeOtherFds(data->server, data->client);
 
 							log_debug("Running main loop.\n");
 							workThreadProc(data);
@@ -136,17 +363,7 @@ int connect(int socket, const struct sockaddr *address,
 						}
 					}
 
-					pthread_attr_t attr = {};
-					CHECKRET(NEXT(pthread, LIBPTHREAD_SO, pthread_attr_init)(&attr),
-						ret == 0, ret, "pthread_attr_init");
-					CHECKRET(NEXT(pthread, LIBPTHREAD_SO, pthread_attr_setdetachstate)(&attr, PTHREAD_CREATE_DETACHED),
-						ret == 0, ret, "pthread_attr_setdetachstate");
-
-					pthread_t workThread;
-					CHECKRET(NEXT(pthread, LIBPTHREAD_SO, pthread_create)
-						(&workThread, &attr, workThreadProc, data),
-						ret == 0, ret, "pthread_create");
-					NEXT(pthread, LIBPTHREAD_SO, pthread_attr_destroy)(&attr);
+					startThread(workThreadProc, data);
 				}
 			}
 		}
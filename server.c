@@ -25,56 +25,228 @@ static void fail(int err, const char* func)
 			ret;						   \
 		})
 
-void handleConnection(int client_socket)
+static void startThread(void* (*proc)(void*), void* arg)
 {
-	struct sockaddr_un address;
-	int  socket_fd;
+	pthread_attr_t attr = {};
+	CHECKRET(pthread_attr_init(&attr),
+		ret == 0, ret, "pthread_attr_init");
+	CHECKRET(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED),
+		ret == 0, ret, "pthread_attr_setdetachstate");
+
+	pthread_t thread;
+	CHECKRET(pthread_create
+		(&thread, &attr, proc, arg),
+		ret == 0, ret, "pthread_create");
+	pthread_attr_destroy(&attr);
+}
+
+// ****************************************************************************
+// Standalone server: a pool of connections to the X server, made ahead of
+// time in the background, so that accepted clients do not wait for connect().
+
+enum { maxServerPool = 64 };
+
+/// The X server drops connections which do not finish the setup in time
+/// (Xorg's -to option, 60 seconds by default), so pooled connections are
+/// replaced once they get this old, and checked for this often.
+#define POOL_MAX_AGE_NS (30 * 1000000000ULL)
+#define POOL_CHECK_SECONDS 5
+
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; // signalled when a connection is taken
+	int display;
+	int size;
+	int count;
+	int fds[maxServerPool];
+	uint64_t connected[maxServerPool]; // monotonicNs() when each was made
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/// Connect to the X server of the given display. Returns -1 (with errno set) on failure.
+static int connectServer(int display)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/.X11-unix/X%d", display);
+
+	int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0)
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
 
+/// Whether a pooled connection is still usable. The X server sends nothing
+/// before the client's setup request, so anything readable means that it
+/// closed the connection (e.g. because it was restarted).
+static bool serverAlive(int fd)
+{
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	return poll(&p, 1, 0) == 0;
+}
+
+static void* poolThreadProc(void* arg)
+{
+	(void)arg;
 	needConfig();
+	pthread_mutex_lock(&pool.mutex);
+	while (true)
+	{
+		// Replace connections which the server closed, or is about to
+		uint64_t now = monotonicNs();
+		for (int i = 0; i < pool.count; i++)
+			if (!serverAlive(pool.fds[i]) || now - pool.connected[i] > POOL_MAX_AGE_NS)
+			{
+				close(pool.fds[i]);
+				pool.count--;
+				pool.fds[i] = pool.fds[pool.count];
+				pool.connected[i] = pool.connected[pool.count];
+				i--;
+			}
 
-	socket_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-	CHECKRET(socket_fd, ret >= 0, errno, "socket");
+		if (pool.count == pool.size)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += POOL_CHECK_SECONDS;
+			pthread_cond_timedwait(&pool.cond, &pool.mutex, &deadline);
+			continue;
+		}
+		pthread_mutex_unlock(&pool.mutex);
 
-	memset(&address, 0, sizeof(struct sockaddr_un));
+		int fd = connectServer(pool.display);
+		if (fd < 0)
+		{
+			// Clients are connected directly meanwhile
+			log_debug("Could not connect to display %d (%s), retrying\n", pool.display, strerror(errno));
+			sleep(1);
+		}
 
-	address.sun_family = AF_UNIX;
-	sprintf(address.sun_path, "/tmp/.X11-unix/X%d", 0);
+		pthread_mutex_lock(&pool.mutex);
+		if (fd >= 0)
+		{
+			pool.fds[pool.count] = fd;
+			pool.connected[pool.count] = monotonicNs();
+			pool.count++;
+		}
+	}
+	return NULL;
+}
 
-	CHECKRET(connect(socket_fd,
-            (struct sockaddr *) &address,
-            sizeof(struct sockaddr_un)),
-		ret == 0, errno, "connect");
+static void startPool()
+{
+	pool.display = config.display;
+	pool.size = config.serverPool;
+	if (pool.size > maxServerPool)
+		pool.size = maxServerPool;
+	if (pool.size > 0)
+		startThread(poolThreadProc, NULL);
+}
+
+/// Take a connection to the X server from the pool (connecting now if it is empty).
+static int takeServer()
+{
+	int fd = -1;
+	pthread_mutex_lock(&pool.mutex);
+	while (fd < 0 && pool.count)
+	{
+		fd = pool.fds[--pool.count];
+		if (!serverAlive(fd))
+		{
+			log_debug("Discarding stale pooled connection to display %d\n", pool.display);
+			close(fd);
+			fd = -1;
+		}
+	}
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.mutex);
 
+	if (fd < 0)
+		fd = CHECKRET(connectServer(pool.display),
+			ret >= 0, errno, "connect");
+	return fd;
+}
+
+void handleConnection(int client_socket)
+{
 	X11ConnData* data = calloc(1, sizeof(X11ConnData));
 	static int index = 0;
 	data->index = index++;
-	data->server = socket_fd;
+	data->display = pool.display;
+	data->server = takeServer();
 	data->client = client_socket;
 
-	pthread_attr_t attr = {};
-	CHECKRET(pthread_attr_init(&attr),
-		ret == 0, ret, "pthread_attr_init");
-	CHECKRET(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED),
-		ret == 0, ret, "pthread_attr_setdetachstate");
+	startThread(workThreadProc, data);
+}
 
-	pthread_t workThread;
-	CHECKRET(pthread_create
-		(&workThread, &attr, workThreadProc, data),
-		ret == 0, ret, "pthread_create");
-	pthread_attr_destroy(&attr);
+/// Per-user relay daemon: relay connections passed by lib.c, each with the
+/// profile of the application it came from.
+static void runDaemon()
+{
+	profile_name = "default"; // for the daemon's own logging settings
+	needConfig();
+
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (!daemonSocketPath(address.sun_path, sizeof(address.sun_path), true))
+		exit(1);
+
+	int socket_fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	CHECKRET(socket_fd, ret >= 0, errno, "socket");
+	unlink(address.sun_path);
+	CHECKRET(bind(socket_fd, (struct sockaddr *) &address, sizeof(address)),
+		ret == 0, errno, "bind");
+	chmod(address.sun_path, 0600);
+	CHECKRET(listen(socket_fd, 16),
+		ret == 0, errno, "listen");
+	log_debug("Relay daemon listening on %s\n", address.sun_path);
+
+	while (true)
+	{
+		int fd = accept4(socket_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fail(errno, "accept");
+		}
+		// Don't let a client which connects and sends nothing stall the daemon
+		struct timeval timeout = { .tv_sec = HANDOFF_TIMEOUT };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		receiveConnection(fd);
+		close(fd);
+	}
 }
 
 int main(int argc, const char **argv)
 {
+	if (argc == 2 && !strcmp(argv[1], "--daemon"))
+	{
+		runDaemon();
+		return 0;
+	}
+
 	if (argc != 3)
 	{
 		log_error("usage: %s PROFILE-NAME LISTEN-PATH\n", argv[0]);
+		log_error("       %s --daemon\n", argv[0]);
 		exit(1);
 	}
 
 	profile_name = argv[1];
 	const char *socket_path = argv[2];
 
+	needConfig();
+	startPool();
+
 	struct sockaddr_un address;
 	int socket_fd, connection_fd;
 	socklen_t address_length;